@@ -1,12 +1,136 @@
 #include <stdlib.h>
 
 #define DATA_BASE_NAME   "database"
+// Can be set at build time like the store geometry in main.c, for every unit using the store. A
+// binary only opens stores created with its own geometry, and kv_store_open fails in a unit built
+// with other values than the library
+#ifndef KEY_MAX_LENGTH
 #define KEY_MAX_LENGTH   32
-#define VALUE_MAX_LENGTH 256
+#endif
+#ifndef VALUE_MAX_LENGTH
+#define VALUE_MAX_LENGTH (1 << 20)
+#endif
+
+#define KV_FILE_BACKED   0x1            // name is a file path, the store survives reboots
+#define KV_ORDERED       0x2            // Keep an ordered index of keys for kv_store_scan, only used if this open creates the store
+#define KV_HUGE_PAGES    0x4            // Ask for transparent huge pages; a file on hugetlbfs gets huge pages regardless
+#define KV_POPULATE      0x8            // Fault the segment in at open and as it grows, rather than on first touch
+#define KV_STATS         0x10           // Count operations per pod and sample hot keys, only used if this open creates the store
+#define KV_COMPRESS      0x20           // Compress large values when that saves space, only used if this open creates the store
+
+// Where the pages of the segment are placed from this open on; in shared memory this holds for every process
+#define KV_NUMA_DEFAULT    0            // On the node of the thread touching them first
+#define KV_NUMA_INTERLEAVE 1            // Round-robin over numa_nodes
+#define KV_NUMA_BIND       2            // Only on numa_nodes
+
+// What a full pod drops once the store cannot grow any further
+#define KV_EVICT_FIFO    0              // The oldest entry
+#define KV_EVICT_CLOCK   1              // The oldest entry not read since the clock hand last passed it
+#define KV_EVICT_LFU     2              // The least often read of a few sampled entries
+
+struct kv_options {
+    int      flags;
+    unsigned checkpoint_ms;             // If non-zero, a thread runs kv_store_checkpoint this often
+    unsigned sweep_ms;                  // If non-zero, a thread drops expired pairs this often
+    int      eviction;                  // KV_EVICT_*, only used if this open creates the store
+    int      numa;                      // KV_NUMA_*
+    unsigned long numa_nodes;           // Bit n set for node n, used by KV_NUMA_INTERLEAVE and KV_NUMA_BIND
+};
 
 extern int  kv_store_create(const char *name);
+extern int  kv_store_open(const char *name, const struct kv_options *opt);
+// Both are called through kv_store_open_geometry, with the limits this unit is built with
+extern int  kv_store_open_geometry(const char *name, const struct kv_options *opt, unsigned key_max, unsigned value_max);
+#define kv_store_create(name)    kv_store_open_geometry(name, NULL, KEY_MAX_LENGTH, VALUE_MAX_LENGTH)
+#define kv_store_open(name, opt) kv_store_open_geometry(name, opt, KEY_MAX_LENGTH, VALUE_MAX_LENGTH)
+extern int  kv_store_checkpoint();
+extern int  kv_store_close();
 extern int  kv_store_write(const char *key, const char *value);
+// The pair expires ttl seconds from now, never if ttl is 0; rewriting a stored pair only resets its expiry
+extern int  kv_store_write_ttl(const char *key, const char *value, unsigned ttl);
+// Makes value the only value of key, in place of any it had; cursors read it as a new value
+extern int  kv_store_put(const char *key, const char *value);
+// Removes every value of key; returns 0 if it had one, 1 otherwise
+extern int  kv_store_delete(const char *key);
+// Atomic read-modify-write of key's newest value, which is replaced as by kv_store_put. cas does so
+// if that value is expected, or if key has no value and expected is NULL; incr adds delta to it,
+// read as a decimal integer and 0 if key has no value, and returns the sum in *result unless
+// result is NULL. Both return 0 if they updated key, 1 if not (no match, not an integer, overflow)
+extern int  kv_store_cas(const char *key, const char *expected, const char *value);
+extern int  kv_store_incr(const char *key, long long delta, long long *result);
+// Returns a copy of key's next value, oldest first, each call resuming where the calling thread's
+// last read of key stopped. Threads keep a fixed number of positions, so a key read after many
+// others may start over from its oldest value
 extern char *kv_store_read(const char *key);
 extern char **kv_store_read_all(const char *key);
 extern int  kv_delete_db();
 
+// Batched writes and reads, grouped by pod so each pod is locked or validated once
+extern int  kv_store_write_batch(const char **keys, const char **values, int n, int *results);
+extern char **kv_store_read_batch(const char **keys, int n);
+
+// Zero-copy reads: cb gets a pointer into the store and the value's length (no terminating NUL).
+// The value stays valid only until cb returns. Compressed values are handed out decompressed, in a
+// temporary copy. Callbacks here and below may call any of the API, views and scans included.
+// kv_store_read_newest_view hands cb the newest value only, the one a fresh kv_store_read_all
+// would end with. All return 0 if the key was found, 1 otherwise
+typedef int (*kv_view_cb)(const char *value, size_t length, void *arg);
+extern int  kv_store_read_view(const char *key, kv_view_cb cb, void *arg);
+extern int  kv_store_read_newest_view(const char *key, kv_view_cb cb, void *arg);
+extern int  kv_store_read_all_view(const char *key, kv_view_cb cb, void *arg);
+
+// Prefix scans, on stores created with KV_ORDERED: cb gets each key starting with prefix, in byte
+// order, and its newest value in place as for the view API, until cb returns non-zero. Returns 0
+// unless the store has no ordered index
+typedef int (*kv_scan_cb)(const char *key, const char *value, size_t length, void *arg);
+extern int  kv_store_scan(const char *prefix, kv_scan_cb cb, void *arg);
+
+// Streams every pair live at the time of the call to cb, in no particular order but each key's
+// values oldest first, without holding up writers: a pod changed meanwhile is copied once,
+// before its first change. Values are in place as for kv_store_scan; cb may write to the store.
+// Returns 1 if another snapshot is running, or if the store ran out of space for copies, in
+// which case some pods were read as they were later than the call
+extern int  kv_store_snapshot(kv_scan_cb cb, void *arg);
+
+// Counters of one pod, or summed over the store. Operations are only counted in stores created with
+// KV_STATS; lock waits, probe lengths and occupancy always are
+#define KV_HOT_KEYS      16
+struct kv_pod_stats {
+    unsigned id;
+    unsigned entries;                   // Entries held, including expired ones not yet dropped
+    unsigned keys;                      // Distinct keys
+    unsigned max_chain;                 // Most entries held by one key
+    unsigned max_probe;                 // Longest index probe a key has needed
+    unsigned long long writes;          // Writes, puts and deletes
+    unsigned long long hits;            // Reads that found a value
+    unsigned long long misses;
+    unsigned long long evictions;       // Entries evicted to make room
+    unsigned long long expired;         // Expired entries and tombstones dropped
+    unsigned long long lock_waits;      // Times a writer found the pod locked
+    unsigned long long lock_wait_ns;    // ... and how long those writers waited in total
+};
+
+struct kv_hot_key {
+    char key[KEY_MAX_LENGTH+1];
+    unsigned long long count;           // Estimated operations on key, from a sample of them
+};
+
+struct kv_stats {
+    unsigned pods;
+    struct kv_pod_stats total;          // Sums, and maxima for the max_ fields
+    int nhot;
+    struct kv_hot_key hot[KV_HOT_KEYS]; // Most used keys first, empty unless the store keeps KV_STATS
+};
+
+// Fills st and, unless cb is NULL, calls it on the counters of each pod. Counters are read without
+// stopping writers, so they are approximate. Returns 1 if no store is open
+typedef void (*kv_pod_stats_cb)(const struct kv_pod_stats *pod, void *arg);
+extern int  kv_store_stats(struct kv_stats *st, kv_pod_stats_cb cb, void *arg);
+
+// Cursors read a key's values oldest first, each call resuming where the last one stopped.
+// kv_cursor_next returns NULL past the newest value; values written later are returned by later calls
+struct kv_cursor;
+extern struct kv_cursor *kv_cursor_open(const char *key);
+extern char *kv_cursor_next(struct kv_cursor *cursor);
+extern void kv_cursor_close(struct kv_cursor *cursor);
+
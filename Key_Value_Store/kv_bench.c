@@ -0,0 +1,457 @@
+/*
+ * Multi-process benchmark harness for the key-value store
+ *
+ * Fills a store with one value for each of KEYS keys, then forks N writer and M reader processes
+ * which run against it for a fixed time. Writers call kv_store_write, readers call kv_store_read
+ * or, for a configurable share of their operations, kv_store_read_all. Keys are drawn from a
+ * uniform, Zipfian or single-hot-key distribution, values have a fixed or uniformly random size.
+ *
+ * Every operation is timed and recorded in a log-linear latency histogram (16 buckets per power
+ * of two, so percentiles are within about 6%). Processes keep their own histograms in a shared
+ * anonymous mapping, merged by the parent, which reports throughput and p50/p99/p999/max latency
+ * per operation type as a table, CSV or JSON. With -S, the run is repeated for 1, 2, 4, ... up to
+ * M readers to check how reads scale. -e picks the eviction policy the store is created with.
+ *
+ * Each process also counts its data TLB load misses with a perf counter, reported per operation
+ * of its kind (readers share one figure for read and read_all), or as - if the counter is not
+ * available. -g, -P and -N map the store with huge pages, pre-faulted, or spread over NUMA
+ * nodes, so runs with and without them show what they save. -c creates the store with KV_COMPRESS;
+ * generated values are mostly padding, so they compress well.
+ *
+ * Build: gcc -std=gnu99 -O2 -o kv_bench kv_bench.c main.c -lpthread -lrt -lm
+ * Usage: ./kv_bench [-w writers] [-r readers] [-t seconds] [-k keys] [-d uniform|zipf|hot]
+ *                   [-z theta] [-H hot_share] [-v size|min:max] [-a read_all_share]
+ *                   [-o text|csv|json] [-F file] [-S] [-e fifo|clock|lfu]
+ *                   [-g] [-P] [-N interleave[:node_mask]|bind:node_mask] [-c]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "config.h"
+
+#define BENCH_DB     "/kv_bench"
+#define HIST_LINEAR  32                // Latencies below this many ns get a bucket each
+#define HIST_SUB     16                // Buckets per power of two above that
+#define HIST_BUCKETS (HIST_LINEAR + 40 * HIST_SUB)
+#define BATCH        64                // Operations between two checks of the clock for the end of the run
+
+enum { OP_WRITE, OP_READ, OP_READ_ALL, NUM_OPS };
+enum { DIST_UNIFORM, DIST_ZIPF, DIST_HOT };
+
+const char* op_name[NUM_OPS]     = { "write", "read", "read_all" };
+const char* dist_name[]          = { "uniform", "zipf", "hot" };
+
+struct s_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+// One per process, in a mapping shared with the parent
+struct s_result {
+    struct s_hist op[NUM_OPS];
+    int64_t       tlb_misses;          // -1 if the counter could not be opened
+};
+
+struct s_config {
+    int    writers;
+    int    readers;
+    double seconds;
+    int    keys;
+    int    dist;
+    double theta;                      // Zipf skew
+    double hot;                        // Share of operations going to the hot key
+    int    val_min;
+    int    val_max;
+    double read_all;                   // Share of reader operations that are kv_store_read_all
+    const char* format;
+    const char* file;                  // Backing file, or NULL for shared memory
+    int    sweep;
+    int    eviction;                   // KV_EVICT_*
+    int    map_flags;                  // KV_HUGE_PAGES, KV_POPULATE, KV_COMPRESS
+    int    numa;                       // KV_NUMA_*
+    unsigned long numa_nodes;
+};
+
+struct s_config cfg = { 1, 4, 2.0, 4096, DIST_UNIFORM, 0.99, 1.0, 8, 8, 0.0, "text", NULL, 0, KV_EVICT_FIFO, 0, KV_NUMA_DEFAULT, 0 };
+
+//************************************************************************************
+// Timing and histograms
+//************************************************************************************
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int hist_index(uint64_t ns) {
+    if(ns < HIST_LINEAR) return (int) ns;
+    int msb = 63 - __builtin_clzll(ns);                   // At least 5 since HIST_LINEAR is 32
+    int i   = HIST_LINEAR + (msb - 5) * HIST_SUB + (int) ((ns >> (msb - 4)) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+// Upper bound of bucket i, so reported percentiles never understate a latency
+uint64_t hist_value(int i) {
+    if(i < HIST_LINEAR) return (uint64_t) i;
+    int msb = (i - HIST_LINEAR) / HIST_SUB + 5;
+    int sub = (i - HIST_LINEAR) % HIST_SUB;
+    return ((uint64_t) (HIST_SUB + sub + 1) << (msb - 4)) - 1;
+}
+
+void hist_add(struct s_hist* h, uint64_t ns) {
+    h->bucket[hist_index(ns)]++;
+    h->count++;
+    if(ns > h->max) h->max = ns;
+}
+
+void hist_merge(struct s_hist* into, const struct s_hist* h) {
+    for(int i = 0; i < HIST_BUCKETS; i++) into->bucket[i] += h->bucket[i];
+    into->count += h->count;
+    if(h->max > into->max) into->max = h->max;
+}
+
+uint64_t hist_percentile(const struct s_hist* h, double p) {
+    uint64_t rank = (uint64_t) ceil(p * h->count), seen = 0;
+    if(rank == 0) rank = 1;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if(seen >= rank) return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+// Opens a counter of this process's user-space data TLB load misses, started at once; -1 if unavailable
+int tlb_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.config         = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int64_t tlb_read(int fd) {
+    uint64_t n;
+    if(fd < 0 || read(fd, &n, sizeof(n)) != sizeof(n)) return -1;
+    close(fd);
+    return (int64_t) n;
+}
+
+//************************************************************************************
+// Key and value generation
+//************************************************************************************
+
+// xorshift64*: rand() is too slow and too short-periodic to pick keys at this rate
+uint64_t rng_state;
+
+uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+double rng_unit(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipf ranks by the method of Gray et al. (also used by YCSB); constants depend on keys and theta
+double zipf_zetan, zipf_eta, zipf_alpha;
+
+void zipf_init(int n, double theta) {
+    double zeta2 = 1.0 + pow(0.5, theta);
+    zipf_zetan = 0;
+    for(int i = 1; i <= n; i++) zipf_zetan += 1.0 / pow(i, theta);
+    zipf_alpha = 1.0 / (1.0 - theta);
+    zipf_eta   = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf_zetan);
+}
+
+int zipf_next(int n, double theta) {
+    double u  = rng_unit();
+    double uz = u * zipf_zetan;
+    if(uz < 1.0) return 0;
+    if(uz < 1.0 + pow(0.5, theta)) return 1;
+    int k = (int) (n * pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+    return k < n ? k : n - 1;
+}
+
+int next_key(void) {
+    switch(cfg.dist) {
+    case DIST_ZIPF: return zipf_next(cfg.keys, cfg.theta);
+    case DIST_HOT:  return rng_unit() < cfg.hot ? 0 : (int) (rng_next() % cfg.keys);
+    default:        return (int) (rng_next() % cfg.keys);
+    }
+}
+
+void make_key(char* buf, int i) {
+    sprintf(buf, "bench_key_%d", i);
+}
+
+// Fills buf with a value of the configured size; the writer id and n make it unique, so it is
+// not rejected as a duplicate pair (unless the size is too small to hold them)
+void make_value(char* buf, int id, long n) {
+    int len = cfg.val_min + (cfg.val_max > cfg.val_min ? (int) (rng_next() % (cfg.val_max - cfg.val_min + 1)) : 0);
+    int p   = snprintf(buf, len + 1, "%d:%ld:", id, n);
+    if(p < len) memset(buf + p, 'x', len - p);
+    buf[len] = 0;
+}
+
+void populate(char* val) {
+    char key[KEY_MAX_LENGTH+1];
+    for(int i = 0; i < cfg.keys; i++) {
+        make_key(key, i);
+        make_value(val, 0, i);
+        kv_store_write(key, val);
+    }
+}
+
+//************************************************************************************
+// Workers
+//************************************************************************************
+
+void writer(int id, struct s_result* res, char* val, uint64_t stop) {
+    char key[KEY_MAX_LENGTH+1];
+    int  tlb = tlb_open();
+    for(long n = 0; now_ns() < stop; ) {
+        for(int i = 0; i < BATCH; i++, n++) {
+            make_key(key, next_key());
+            make_value(val, id + 1, n);
+            uint64_t t = now_ns();
+            kv_store_write(key, val);
+            hist_add(&res->op[OP_WRITE], now_ns() - t);
+        }
+    }
+    res->tlb_misses = tlb_read(tlb);
+    exit(0);
+}
+
+void reader(struct s_result* res, uint64_t stop) {
+    char key[KEY_MAX_LENGTH+1];
+    int  tlb = tlb_open();
+    while(now_ns() < stop) {
+        for(int i = 0; i < BATCH; i++) {
+            make_key(key, next_key());
+            if(cfg.read_all > 0 && rng_unit() < cfg.read_all) {
+                uint64_t t = now_ns();
+                char** all = kv_store_read_all(key);
+                hist_add(&res->op[OP_READ_ALL], now_ns() - t);
+                if(all != NULL) {
+                    for(int j = 0; all[j] != NULL; j++) free(all[j]);
+                    free(all);
+                }
+            }
+            else {
+                uint64_t t = now_ns();
+                char* v = kv_store_read(key);
+                hist_add(&res->op[OP_READ], now_ns() - t);
+                free(v);
+            }
+        }
+    }
+    res->tlb_misses = tlb_read(tlb);
+    exit(0);
+}
+
+//************************************************************************************
+// Reporting
+//************************************************************************************
+
+int rows = 0;
+
+void print_header(void) {
+    if(!strcmp(cfg.format, "csv")) {
+        printf("writers,readers,dist,keys,value_min,value_max,op,ops,ops_per_s,p50_ns,p99_ns,p999_ns,max_ns,tlb_misses_per_op\n");
+    }
+    else if(!strcmp(cfg.format, "json")) printf("[\n");
+    else printf("writers\treaders\top\tops_per_s\tp50_ns\tp99_ns\tp999_ns\tmax_ns\ttlb_misses_per_op\n");
+}
+
+// tlb is the TLB misses per operation, negative if not counted
+void print_row(int readers, int op, const struct s_hist* h, double seconds, double tlb) {
+    uint64_t p50 = hist_percentile(h, 0.5), p99 = hist_percentile(h, 0.99), p999 = hist_percentile(h, 0.999);
+    double   rate = h->count / seconds;
+    char     misses[32];
+    if(!strcmp(cfg.format, "csv")) {
+        if(tlb < 0) misses[0] = 0;
+        else snprintf(misses, sizeof(misses), "%.3f", tlb);
+        printf("%d,%d,%s,%d,%d,%d,%s,%llu,%.0f,%llu,%llu,%llu,%llu,%s\n", cfg.writers, readers,
+               dist_name[cfg.dist], cfg.keys, cfg.val_min, cfg.val_max, op_name[op],
+               (unsigned long long) h->count, rate, (unsigned long long) p50, (unsigned long long) p99,
+               (unsigned long long) p999, (unsigned long long) h->max, misses);
+    }
+    else if(!strcmp(cfg.format, "json")) {
+        if(tlb < 0) strcpy(misses, "null");
+        else snprintf(misses, sizeof(misses), "%.3f", tlb);
+        printf("%s  {\"writers\": %d, \"readers\": %d, \"dist\": \"%s\", \"keys\": %d, \"value_min\": %d, "
+               "\"value_max\": %d, \"op\": \"%s\", \"ops\": %llu, \"ops_per_s\": %.0f, \"p50_ns\": %llu, "
+               "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, \"tlb_misses_per_op\": %s}",
+               rows ? ",\n" : "", cfg.writers, readers, dist_name[cfg.dist], cfg.keys, cfg.val_min,
+               cfg.val_max, op_name[op], (unsigned long long) h->count, rate, (unsigned long long) p50,
+               (unsigned long long) p99, (unsigned long long) p999, (unsigned long long) h->max, misses);
+    }
+    else {
+        if(tlb < 0) strcpy(misses, "-");
+        else snprintf(misses, sizeof(misses), "%.3f", tlb);
+        printf("%d\t%d\t%s\t%.0f\t%llu\t%llu\t%llu\t%llu\t%s\n", cfg.writers, readers, op_name[op], rate,
+               (unsigned long long) p50, (unsigned long long) p99, (unsigned long long) p999,
+               (unsigned long long) h->max, misses);
+    }
+    rows++;
+}
+
+void print_footer(void) {
+    if(!strcmp(cfg.format, "json")) printf("\n]\n");
+}
+
+// kv_delete_db reports on stdout, which would end up in the middle of CSV or JSON output
+void delete_quietly(void) {
+    fflush(stdout);
+    int out  = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if(null >= 0) dup2(null, STDOUT_FILENO);
+    kv_delete_db();
+    fflush(stdout);
+    if(out >= 0) dup2(out, STDOUT_FILENO);
+    if(null >= 0) close(null);
+    if(out >= 0) close(out);
+}
+
+//************************************************************************************
+// Driver
+//************************************************************************************
+
+// Runs writers and readers against the store for the configured time and prints their results
+int run(int readers, char* val) {
+    int procs = cfg.writers + readers;
+    struct s_result* res = mmap(NULL, procs * sizeof(struct s_result), PROT_READ|PROT_WRITE,
+                                MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(res == MAP_FAILED) return 1;
+
+    fflush(stdout);                                       // Children must not inherit buffered output
+    uint64_t start = now_ns();
+    uint64_t stop  = start + (uint64_t) (cfg.seconds * 1e9);
+    for(int i = 0; i < procs; i++) {
+        if(fork() == 0) {
+            rng_state = 0x9E3779B97F4A7C15ull * (i + 1) ^ start;
+            if(i < cfg.writers) writer(i, &res[i], val, stop);
+            else reader(&res[i], stop);
+        }
+    }
+    while(wait(NULL) > 0);
+    double seconds = (now_ns() - start) / 1e9;
+
+    // TLB misses per operation of writers and of readers, -1 unless every process counted them
+    double   tlb[2];
+    for(int role = 0; role < 2; role++) {
+        int64_t  misses  = 0;
+        uint64_t ops     = 0;
+        int      counted = 1;
+        for(int i = role ? cfg.writers : 0; i < (role ? procs : cfg.writers); i++) {
+            counted &= res[i].tlb_misses >= 0;
+            misses  += res[i].tlb_misses;
+            for(int op = 0; op < NUM_OPS; op++) ops += res[i].op[op].count;
+        }
+        tlb[role] = !counted || ops == 0 ? -1 : (double) misses / ops;
+    }
+
+    struct s_hist total;
+    for(int op = 0; op < NUM_OPS; op++) {
+        memset(&total, 0, sizeof(total));
+        for(int i = 0; i < procs; i++) hist_merge(&total, &res[i].op[op]);
+        if(total.count) print_row(readers, op, &total, seconds, tlb[op != OP_WRITE]);
+    }
+    munmap(res, procs * sizeof(struct s_result));
+    return 0;
+}
+
+int parse_args(int argc, char** argv) {
+    int c;
+    while((c = getopt(argc, argv, "w:r:t:k:d:z:H:v:a:o:F:Se:gPN:c")) != -1) {
+        switch(c) {
+        case 'w': cfg.writers  = atoi(optarg); break;
+        case 'r': cfg.readers  = atoi(optarg); break;
+        case 't': cfg.seconds  = atof(optarg); break;
+        case 'k': cfg.keys     = atoi(optarg); break;
+        case 'z': cfg.theta    = atof(optarg); break;
+        case 'H': cfg.hot      = atof(optarg); break;
+        case 'a': cfg.read_all = atof(optarg); break;
+        case 'o': cfg.format   = optarg;       break;
+        case 'F': cfg.file     = optarg;       break;
+        case 'S': cfg.sweep    = 1;            break;
+        case 'g': cfg.map_flags |= KV_HUGE_PAGES; break;
+        case 'P': cfg.map_flags |= KV_POPULATE;   break;
+        case 'c': cfg.map_flags |= KV_COMPRESS;   break;
+        case 'N':
+            if(!strncmp(optarg, "interleave", 10)) cfg.numa = KV_NUMA_INTERLEAVE;
+            else if(!strncmp(optarg, "bind:", 5))  cfg.numa = KV_NUMA_BIND;
+            else return 1;
+            cfg.numa_nodes = strchr(optarg, ':') != NULL ? strtoul(strchr(optarg, ':') + 1, NULL, 0) : ~0ul; // Default: every node
+            break;
+        case 'd':
+            if(!strcmp(optarg, "uniform"))   cfg.dist = DIST_UNIFORM;
+            else if(!strcmp(optarg, "zipf")) cfg.dist = DIST_ZIPF;
+            else if(!strcmp(optarg, "hot"))  cfg.dist = DIST_HOT;
+            else return 1;
+            break;
+        case 'e':
+            if(!strcmp(optarg, "fifo"))       cfg.eviction = KV_EVICT_FIFO;
+            else if(!strcmp(optarg, "clock")) cfg.eviction = KV_EVICT_CLOCK;
+            else if(!strcmp(optarg, "lfu"))   cfg.eviction = KV_EVICT_LFU;
+            else return 1;
+            break;
+        case 'v':
+            if(sscanf(optarg, "%d:%d", &cfg.val_min, &cfg.val_max) != 2) cfg.val_max = cfg.val_min = atoi(optarg);
+            break;
+        default: return 1;
+        }
+    }
+    if(cfg.writers < 0 || cfg.readers < 0 || cfg.writers + cfg.readers == 0 || cfg.keys < 2) return 1;
+    if(cfg.val_min < 1 || cfg.val_max < cfg.val_min || cfg.val_max > VALUE_MAX_LENGTH) return 1;
+    if(cfg.theta <= 0 || cfg.theta == 1.0) return 1;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if(parse_args(argc, argv)) {
+        fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-t seconds] [-k keys] [-d uniform|zipf|hot]\n"
+                        "       [-z theta] [-H hot_share] [-v size|min:max] [-a read_all_share]\n"
+                        "       [-o text|csv|json] [-F file] [-S] [-e fifo|clock|lfu]\n"
+                        "       [-g] [-P] [-N interleave[:node_mask]|bind:node_mask] [-c]\n", argv[0]);
+        return 1;
+    }
+    if(cfg.dist == DIST_ZIPF) zipf_init(cfg.keys, cfg.theta);
+
+    struct kv_options opt = { (cfg.file != NULL ? KV_FILE_BACKED : 0) | cfg.map_flags, 0, 0, cfg.eviction, cfg.numa, cfg.numa_nodes };
+    if(kv_store_open(cfg.file != NULL ? cfg.file : BENCH_DB, &opt)) return 1;
+    char* val = malloc(cfg.val_max + 1);
+    if(val == NULL) return 1;
+    rng_state = 0x2545F4914F6CDD1Dull;
+    populate(val);
+
+    print_header();
+    if(cfg.sweep && cfg.readers > 0) {
+        for(int r = 1; r <= cfg.readers; r *= 2) run(r, val);
+    }
+    else run(cfg.readers, val);
+    print_footer();
+
+    free(val);
+    delete_quietly();
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Crash stress test for the key-value store
+ *
+ * Forks workers that replace the values of a small set of keys as fast as they can, so almost
+ * every write retires a record and the arena keeps reclaiming, while reading values back through
+ * the view API, which pins epochs. The parent SIGKILLs a random worker every few milliseconds,
+ * wherever it is, and starts another. Every value names its key and is padded with a character
+ * derived from it, so a block handed out twice, a torn record or a pod left inconsistent shows up
+ * as a value that does not match its key. After the last round every key is checked again.
+ *
+ * Exits 0 if no mismatch was seen, 1 if one was, 2 if the store hung (no progress for a while).
+ *
+ * Build: gcc -std=gnu99 -O2 -o kv_crash_test kv_crash_test.c main.c -lpthread -lrt
+ * Usage: ./kv_crash_test [-w workers] [-r rounds] [-k keys] name
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "config.h"
+
+#define MAX_WORKERS 64
+#define STALL_MS    10000              // A round with no write anywhere for this long is a hang
+
+struct s_shared {
+    volatile long writes;
+    volatile long errors;
+};
+
+struct s_shared* shared;
+int   keys = 64, workers = 4;
+pid_t pid[MAX_WORKERS];
+
+void make_key(char* buf, int i) {
+    sprintf(buf, "crash_%d", i);
+}
+
+// "<key>:<n>:" then padding up to len, with a character only this key uses
+int make_value(char* buf, int i, long n, int len) {
+    int p = sprintf(buf, "crash_%d:%ld:", i, n);
+    if(p < len) memset(buf + p, 'a' + i % 26, len - p);
+    buf[len > p ? len : p] = 0;
+    return len > p ? len : p;
+}
+
+int check_value(const char* v, size_t len, int i) {
+    char prefix[32];
+    int  p = sprintf(prefix, "crash_%d:", i);
+    if(len < (size_t) p || memcmp(v, prefix, p)) return 1;
+    size_t k = p;
+    while(k < len && v[k] >= '0' && v[k] <= '9') k++;
+    if(k == (size_t) p || k == len || v[k++] != ':') return 1;
+    for(; k < len; k++) if(v[k] != 'a' + i % 26) return 1;
+    return 0;
+}
+
+int view_check(const char* value, size_t len, void* arg) {
+    if(check_value(value, len, *(int*) arg)) __sync_fetch_and_add(&shared->errors, 1);
+    return 0;
+}
+
+// Runs on the mapping inherited from the parent, until killed
+void worker(int id) {
+    srand(getpid());
+    char key[KEY_MAX_LENGTH+1], val[2048];
+    for(long n = 0; ; n++) {
+        int i = rand() % keys;
+        make_key(key, i);
+        if(rand() % 2) {
+            make_value(val, i, n * MAX_WORKERS + id, 16 + rand() % 1500);
+            if(kv_store_put(key, val) == 0) __sync_fetch_and_add(&shared->writes, 1);
+        }
+        else kv_store_read_all_view(key, view_check, &i);
+    }
+}
+
+pid_t spawn(int id) {
+    pid_t pid = fork();
+    if(pid == 0) worker(id);
+    return pid;
+}
+
+void on_alarm(int sig) {
+    (void) sig;
+    for(int w = 0; w < workers; w++) kill(pid[w], SIGKILL);
+    fprintf(stderr, "No progress for %d ms: the store hung\n", STALL_MS);
+    _exit(2);
+}
+
+int main(int argc, char** argv) {
+    int c, rounds = 500;
+    while((c = getopt(argc, argv, "w:r:k:")) != -1) {
+        switch(c) {
+        case 'w': workers = atoi(optarg); break;
+        case 'r': rounds  = atoi(optarg); break;
+        case 'k': keys    = atoi(optarg); break;
+        default:  optind = argc + 1;      break;
+        }
+    }
+    if(optind != argc - 1 || workers < 1 || workers > MAX_WORKERS || rounds < 1 || keys < 1) {
+        fprintf(stderr, "Usage: %s [-w workers] [-r rounds] [-k keys] name\n", argv[0]);
+        return 1;
+    }
+    const char* name = argv[optind];
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED) return 1;
+    if(kv_store_create(name)) return 1;
+
+    signal(SIGALRM, on_alarm);
+    for(int w = 0; w < workers; w++) pid[w] = spawn(w);
+    srand(time(NULL));
+    long last = 0;
+    for(int r = 0; r < rounds; r++) {
+        struct timespec t = { 0, (1 + rand() % 10) * 1000000L };
+        nanosleep(&t, NULL);
+        int w = rand() % workers;
+        kill(pid[w], SIGKILL);
+        waitpid(pid[w], NULL, 0);
+        pid[w] = spawn(w);
+        if(shared->writes != last) {
+            last = shared->writes;
+            alarm(STALL_MS / 1000);
+        }
+    }
+    for(int w = 0; w < workers; w++) {
+        kill(pid[w], SIGKILL);
+        waitpid(pid[w], NULL, 0);
+    }
+
+    // Every key must still hold well-formed values, and take new ones
+    alarm(STALL_MS / 1000);
+    char key[KEY_MAX_LENGTH+1], val[2048];
+    for(int i = 0; i < keys; i++) {
+        make_key(key, i);
+        kv_store_read_all_view(key, view_check, &i);
+        make_value(val, i, 0, 100);
+        if(kv_store_put(key, val)) shared->errors++;
+        kv_store_read_all_view(key, view_check, &i);
+    }
+    alarm(0);
+    printf("%d rounds, %ld writes, %ld errors\n", rounds, shared->writes, shared->errors);
+    kv_delete_db();
+    return shared->errors != 0;
+}
@@ -0,0 +1,522 @@
+/*
+ * Network front-end for the key-value store
+ *
+ * Attaches to a store and serves it over TCP with a subset of the Redis protocol (RESP), so
+ * redis-cli, redis-benchmark and Redis client libraries can talk to it. Requests are arrays of
+ * bulk strings; the commands are:
+ *
+ *   PING                       +PONG
+ *   SET key value              Makes value the only value of key (kv_store_put); +OK
+ *   ADD key value              Adds a value to key (kv_store_write); :1 if added, :0 if not
+ *   ADDEX key seconds value    The same, expiring after seconds (kv_store_write_ttl)
+ *   SETNX key value            SET if key has no value (kv_store_cas); :1 if set, :0 if not
+ *   CAS key expected value     SET if the newest value of key is expected; :1 if set, :0 if not
+ *   INCRBY key n               Adds n to the newest value of key, a decimal integer taken as 0 if
+ *                              key has none, and makes the sum its only value (kv_store_incr); :sum
+ *   INCR, DECR, DECRBY         The same with n 1, -1 or -n
+ *   GET key                    The newest value of key, or nil
+ *   VALUES key                 Every value of key, oldest first
+ *   DEL key [key ...]          Removes keys; the number that had a value
+ *   SCAN prefix                Keys starting with prefix and their newest values, in key order,
+ *                              as a flat array; stores created with KV_ORDERED only
+ *   QUIT                       +OK, then the connection is closed
+ *
+ * Keys are at most KEY_MAX_LENGTH bytes, and no argument may contain a NUL byte: the store keeps
+ * C strings. Requests breaking either get an error reply.
+ *
+ * One thread per core runs its own epoll loop on its own listening socket (SO_REUSEPORT lets the
+ * kernel spread connections over them), so threads share nothing but the store. Clients may
+ * pipeline: every complete request a read brings in is served, and their replies go out in one
+ * write. A connection whose replies pile up past OUT_HIGH is not read from until they drain. Values are copied from the store into the reply buffer in place, without an
+ * intermediate copy.
+ *
+ * Build: gcc -std=gnu99 -O2 -o kv_server kv_server.c main.c -lpthread -lrt
+ * Usage: ./kv_server [-p port] [-n threads] [-F] name
+ *        -F: name is the backing file of a file-backed store, not a shared memory object
+ *
+ */
+
+#define _GNU_SOURCE                    // accept4, pthread_setaffinity_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "config.h"
+
+#define DEFAULT_PORT  7379
+#define MAX_EVENTS    256
+#define READ_CHUNK    (64 << 10)       // Bytes asked for by each read
+#define OUT_HIGH      (4 << 20)        // Replies pending past which requests wait until they drain
+#define MAX_ARGS      64               // DEL takes many keys, the other commands at most 3 arguments
+#define MAX_BULK      (VALUE_MAX_LENGTH + 64)
+#define IN_MAX        ((size_t) MAX_ARGS * (MAX_BULK + 32) + READ_CHUNK)  // The largest request, plus a read
+#define POLL_MS       100              // How often idle loops check for shutdown
+
+struct s_buf {
+    char*  data;
+    size_t len;
+    size_t off;                        // Consumed (input) or sent (output) so far
+    size_t cap;
+};
+
+struct s_conn {
+    int          fd;
+    int          closing;              // Close once the pending replies are sent
+    uint32_t     events;               // Interest set registered with epoll
+    struct s_buf in;
+    struct s_buf out;
+};
+
+// A parsed request; arguments point into the input buffer and are NUL-terminated in place
+struct s_req {
+    int    argc;
+    char*  argv[MAX_ARGS];
+    size_t len[MAX_ARGS];
+};
+
+struct s_config {
+    int port;
+    int threads;
+    int file;
+};
+
+struct s_config cfg = { DEFAULT_PORT, 0, 0 };
+volatile sig_atomic_t running = 1;
+
+//************************************************************************************
+// Buffers
+//************************************************************************************
+
+// Makes room for n more bytes; returns 1 if out of memory
+int buf_reserve(struct s_buf* b, size_t n) {
+    if(b->len + n <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : READ_CHUNK;
+    while(cap < b->len + n) cap *= 2;
+    char* d = realloc(b->data, cap);
+    if(d == NULL) return 1;
+    b->data = d;
+    b->cap  = cap;
+    return 0;
+}
+
+void buf_append(struct s_buf* b, const void* data, size_t n) {
+    if(buf_reserve(b, n)) return;
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+// Drops the consumed part, so the buffer does not grow with the connection's lifetime
+void buf_compact(struct s_buf* b) {
+    if(b->off == 0) return;
+    memmove(b->data, b->data + b->off, b->len - b->off);
+    b->len -= b->off;
+    b->off  = 0;
+}
+
+void buf_free(struct s_buf* b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+//************************************************************************************
+// Replies
+//************************************************************************************
+
+void reply_str(struct s_buf* b, const char* s) {
+    buf_append(b, s, strlen(s));
+}
+
+void reply_int(struct s_buf* b, long long n) {
+    char h[32];
+    buf_append(b, h, snprintf(h, sizeof(h), ":%lld\r\n", n));
+}
+
+void reply_bulk(struct s_buf* b, const char* data, size_t len) {
+    char h[32];
+    int  n = snprintf(h, sizeof(h), "$%zu\r\n", len);
+    if(buf_reserve(b, n + len + 2)) return;
+    buf_append(b, h, n);
+    buf_append(b, data, len);
+    buf_append(b, "\r\n", 2);
+}
+
+// Array replies whose length is only known once their elements are written: the header is
+// inserted in front of them afterwards
+void reply_array_at(struct s_buf* b, size_t start, long long n) {
+    char h[32];
+    int  hn = snprintf(h, sizeof(h), "*%lld\r\n", n);
+    if(buf_reserve(b, hn)) return;
+    memmove(b->data + start + hn, b->data + start, b->len - start);
+    memcpy(b->data + start, h, hn);
+    b->len += hn;
+}
+
+struct s_collect {
+    struct s_buf* out;
+    size_t        start;               // Where the reply begins
+    long long     n;
+};
+
+// GET and VALUES: appends each value handed out to the reply
+int add_value(const char* value, size_t len, void* arg) {
+    struct s_collect* c = arg;
+    reply_bulk(c->out, value, len);
+    c->n++;
+    return 0;
+}
+
+int add_pair(const char* key, const char* value, size_t len, void* arg) {
+    struct s_collect* c = arg;
+    reply_bulk(c->out, key, strlen(key));
+    reply_bulk(c->out, value, len);
+    c->n += 2;
+    return 0;
+}
+
+//************************************************************************************
+// Requests
+//************************************************************************************
+
+// INCR, INCRBY, DECR and DECRBY; n is the argument of the last two, NULL for the others
+void reply_incr(struct s_buf* out, const char* key, const char* n, int sign) {
+    long long delta = 1, v;
+    char*     end;
+    if(n != NULL) {
+        errno = 0;
+        delta = strtoll(n, &end, 10);
+        if(errno || end == n || *end || (sign < 0 && delta == LLONG_MIN)) {
+            reply_str(out, "-ERR value is not an integer or out of range\r\n");
+            return;
+        }
+    }
+    if(kv_store_incr(key, sign * delta, &v)) reply_str(out, "-ERR value is not an integer or out of range\r\n");
+    else reply_int(out, v);
+}
+
+// Parses a decimal line ending in CRLF at p, of at most n bytes; returns the bytes used, 0 if the
+// line is incomplete, -1 if it is not a number
+long parse_line(const char* p, size_t n, long long* v) {
+    size_t i = 0, digits;
+    int    neg = 0;
+    *v = 0;
+    if(i < n && p[i] == '-') neg = 1, i++;
+    for(digits = i; i < n && p[i] >= '0' && p[i] <= '9'; i++) {
+        *v = *v * 10 + (p[i] - '0');
+        if(*v > MAX_BULK) return -1;
+    }
+    if(i == n || (i + 1 == n && p[i] == '\r')) return 0;
+    if(i == digits || p[i] != '\r' || p[i+1] != '\n') return -1;
+    if(neg) *v = -*v;
+    return (long) i + 2;
+}
+
+// Parses one request at the start of p; returns the bytes it takes, 0 if it is incomplete, -1
+// if it is malformed
+long parse_request(char* p, size_t n, struct s_req* r) {
+    long long v;
+    long      used, at = 1;
+    if(n == 0) return 0;
+    if(p[0] != '*') return -1;
+    if((used = parse_line(p + at, n - at, &v)) <= 0) return used;
+    if(v < 1 || v > MAX_ARGS) return -1;
+    at += used;
+    r->argc = (int) v;
+    for(int i = 0; i < r->argc; i++) {
+        if((size_t) at >= n) return 0;
+        if(p[at++] != '$') return -1;
+        if((used = parse_line(p + at, n - at, &v)) <= 0) return used;
+        if(v < 0) return -1;
+        at += used;
+        if((size_t) (at + v + 2) > n) return 0;
+        if(p[at + v] != '\r' || p[at + v + 1] != '\n') return -1;
+        r->argv[i] = p + at;
+        r->len[i]  = (size_t) v;
+        at += v + 2;
+    }
+    // Only once the request is complete: an incomplete one is parsed again when more arrives
+    for(int i = 0; i < r->argc; i++) r->argv[i][r->len[i]] = 0;  // The CR becomes the terminating NUL
+    return at;
+}
+
+// Bulk strings may hold any byte, but the store takes NUL-terminated keys and values, and keys
+// of at most KEY_MAX_LENGTH bytes; returns the error reply for a request it cannot take, or NULL
+const char* check_args(const struct s_req* r) {
+    for(int i = 0; i < r->argc; i++) {
+        if(memchr(r->argv[i], 0, r->len[i]) != NULL) return "-ERR arguments may not contain NUL bytes\r\n";
+    }
+    int keys = strcasecmp(r->argv[0], "DEL") ? 2 : r->argc;  // Every command but PING and QUIT starts with a key
+    for(int i = 1; i < keys && i < r->argc; i++) {
+        if(r->len[i] > KEY_MAX_LENGTH) return "-ERR key too long\r\n";
+    }
+    return NULL;
+}
+
+// Runs one request, appending its reply to out; returns 1 if the connection should close
+int serve(struct s_req* r, struct s_buf* out) {
+    const char* cmd = r->argv[0];
+    const char* err = check_args(r);
+    struct s_collect c = { out, out->len, 0 };
+    if(err != NULL) reply_str(out, err);
+    else if(!strcasecmp(cmd, "PING") && r->argc == 1) reply_str(out, "+PONG\r\n");
+    else if(!strcasecmp(cmd, "SET") && r->argc == 3) {
+        reply_str(out, kv_store_put(r->argv[1], r->argv[2]) ? "-ERR store full or value too long\r\n" : "+OK\r\n");
+    }
+    else if(!strcasecmp(cmd, "ADD") && r->argc == 3) reply_int(out, !kv_store_write(r->argv[1], r->argv[2]));
+    else if(!strcasecmp(cmd, "ADDEX") && r->argc == 4) {
+        char* end;
+        unsigned long ttl = strtoul(r->argv[2], &end, 10);
+        if(*end || end == r->argv[2]) reply_str(out, "-ERR invalid expire time\r\n");
+        else reply_int(out, !kv_store_write_ttl(r->argv[1], r->argv[3], (unsigned) ttl));
+    }
+    else if(!strcasecmp(cmd, "SETNX") && r->argc == 3) reply_int(out, !kv_store_cas(r->argv[1], NULL, r->argv[2]));
+    else if(!strcasecmp(cmd, "CAS") && r->argc == 4) reply_int(out, !kv_store_cas(r->argv[1], r->argv[2], r->argv[3]));
+    else if(!strcasecmp(cmd, "INCR") && r->argc == 2)   reply_incr(out, r->argv[1], NULL, 1);
+    else if(!strcasecmp(cmd, "DECR") && r->argc == 2)   reply_incr(out, r->argv[1], NULL, -1);
+    else if(!strcasecmp(cmd, "INCRBY") && r->argc == 3) reply_incr(out, r->argv[1], r->argv[2], 1);
+    else if(!strcasecmp(cmd, "DECRBY") && r->argc == 3) reply_incr(out, r->argv[1], r->argv[2], -1);
+    else if(!strcasecmp(cmd, "GET") && r->argc == 2) {
+        kv_store_read_newest_view(r->argv[1], add_value, &c);
+        if(c.n == 0) reply_str(out, "$-1\r\n");
+    }
+    else if(!strcasecmp(cmd, "VALUES") && r->argc == 2) {
+        kv_store_read_all_view(r->argv[1], add_value, &c);
+        reply_array_at(out, c.start, c.n);
+    }
+    else if(!strcasecmp(cmd, "DEL") && r->argc >= 2) {
+        long long n = 0;
+        for(int i = 1; i < r->argc; i++) n += !kv_store_delete(r->argv[i]);
+        reply_int(out, n);
+    }
+    else if(!strcasecmp(cmd, "SCAN") && r->argc == 2) {
+        if(kv_store_scan(r->argv[1], add_pair, &c)) {
+            out->len = c.start;
+            reply_str(out, "-ERR store has no ordered index\r\n");
+        }
+        else reply_array_at(out, c.start, c.n);
+    }
+    else if(!strcasecmp(cmd, "QUIT")) {
+        reply_str(out, "+OK\r\n");
+        return 1;
+    }
+    else reply_str(out, "-ERR unknown command or wrong number of arguments\r\n");
+    return 0;
+}
+
+//************************************************************************************
+// Connections
+//************************************************************************************
+
+void close_conn(int ep, struct s_conn* c) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    buf_free(&c->in);
+    buf_free(&c->out);
+    free(c);
+}
+
+// Serves the complete requests in the input buffer while replies are not piling up; returns 1
+// if some were held back
+int serve_input(struct s_conn* c) {
+    struct s_req r;
+    int held = 0;
+    while(!c->closing && !(held = c->out.len - c->out.off >= OUT_HIGH)) {
+        long used = parse_request(c->in.data + c->in.off, c->in.len - c->in.off, &r);
+        if(used == 0) break;
+        if(used < 0) {
+            reply_str(&c->out, "-ERR protocol error\r\n");
+            c->closing = 1;
+            break;
+        }
+        c->in.off += used;
+        c->closing = serve(&r, &c->out);
+    }
+    buf_compact(&c->in);
+    return held;
+}
+
+// Sends what replies it can; returns 1 on a connection error
+int flush_output(struct s_conn* c) {
+    while(c->out.off < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out.off, c->out.len - c->out.off, MSG_NOSIGNAL);
+        if(n < 0) return errno != EAGAIN && errno != EWOULDBLOCK;
+        c->out.off += n;
+    }
+    c->out.off = c->out.len = 0;
+    return 0;
+}
+
+// Waits for the socket to drain only while replies are pending, and stops reading while they
+// pile up, so a client that sends without reading does not grow the input buffer either
+void watch_output(int ep, struct s_conn* c) {
+    uint32_t events = (c->out.len - c->out.off < OUT_HIGH ? EPOLLIN : 0) | (c->out.off < c->out.len ? EPOLLOUT : 0);
+    if(events == c->events) return;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+void handle_conn(int ep, struct s_conn* c, uint32_t events) {
+    if(events & (EPOLLERR | EPOLLHUP)) {
+        close_conn(ep, c);
+        return;
+    }
+    if(events & EPOLLIN) {
+        if(buf_reserve(&c->in, READ_CHUNK)) {
+            close_conn(ep, c);
+            return;
+        }
+        ssize_t n = recv(c->fd, c->in.data + c->in.len, READ_CHUNK, 0);
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            close_conn(ep, c);
+            return;
+        }
+        if(n > 0) c->in.len += n;
+        if(c->in.len > IN_MAX) {                          // Not a request parse_request can accept
+            close_conn(ep, c);
+            return;
+        }
+    }
+    // Every request this read completed is answered by one send, as are those held back
+    // while earlier replies drained, for as long as the socket takes them all
+    int held;
+    do {
+        held = serve_input(c);
+        if(flush_output(c) || (c->closing && c->out.off == c->out.len)) {
+            close_conn(ep, c);
+            return;
+        }
+    } while(held && c->out.len == 0);
+    watch_output(ep, c);
+}
+
+void accept_conns(int ep, int lfd) {
+    for(;;) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) return;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct s_conn* c = calloc(1, sizeof(struct s_conn));
+        if(c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd     = fd;
+        c->events = EPOLLIN;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev)) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+//************************************************************************************
+// Event loops
+//************************************************************************************
+
+int listen_socket(int port) {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+    int one = 1, zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));   // IPv4 clients too
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons(port), .sin6_addr = IN6ADDR_ANY_INIT };
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// One per core: its own listening socket and epoll set, so loops never contend with each other.
+// The listening socket is marker data.ptr NULL; connections carry their s_conn
+void* event_loop(void* arg) {
+    int lfd = (int) (long) arg;
+    int ep  = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if(ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev)) {
+        printf("Failed to set up event loop\n");
+        return NULL;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while(running) {
+        int n = epoll_wait(ep, events, MAX_EVENTS, POLL_MS);
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.ptr == NULL) accept_conns(ep, lfd);
+            else handle_conn(ep, events[i].data.ptr, events[i].events);
+        }
+    }
+    close(ep);                                            // Connections die with the process
+    close(lfd);
+    return NULL;
+}
+
+void stop(int sig) {
+    (void) sig;
+    running = 0;
+}
+
+int parse_args(int argc, char** argv) {
+    int c;
+    while((c = getopt(argc, argv, "p:n:F")) != -1) {
+        switch(c) {
+        case 'p': cfg.port    = atoi(optarg); break;
+        case 'n': cfg.threads = atoi(optarg); break;
+        case 'F': cfg.file    = 1;            break;
+        default: return 1;
+        }
+    }
+    if(cfg.threads <= 0) cfg.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    return optind != argc - 1 || cfg.port <= 0 || cfg.port > 65535 || cfg.threads <= 0;
+}
+
+int main(int argc, char** argv) {
+    if(parse_args(argc, argv)) {
+        fprintf(stderr, "Usage: %s [-p port] [-n threads] [-F] name\n", argv[0]);
+        return 1;
+    }
+    struct kv_options opt = { cfg.file ? KV_FILE_BACKED : 0, 0, 0, KV_EVICT_FIFO, KV_NUMA_DEFAULT, 0 };
+    if(kv_store_open(argv[optind], &opt)) return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = { .sa_handler = stop };         // No SA_RESTART: epoll_wait returns at once
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pthread_t* loop  = calloc(cfg.threads, sizeof(pthread_t));
+    int        ncpu  = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int        nloop = 0;
+    for(int i = 0; loop != NULL && i < cfg.threads; i++) {
+        int lfd = listen_socket(cfg.port);
+        if(lfd < 0) {
+            printf("Failed to listen on port %d\n", cfg.port);
+            break;
+        }
+        if(pthread_create(&loop[nloop], NULL, event_loop, (void*) (long) lfd)) {
+            close(lfd);
+            break;
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % ncpu, &cpus);
+        pthread_setaffinity_np(loop[nloop++], sizeof(cpus), &cpus);
+    }
+    if(nloop) printf("Serving %s on port %d with %d threads\n", argv[optind], cfg.port, nloop);
+    fflush(stdout);
+    for(int i = 0; i < nloop; i++) pthread_join(loop[i], NULL);
+    free(loop);
+    kv_store_close();
+    return nloop == 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Statistics dumper for the key-value store
+ *
+ * Attaches to an existing store, prints its totals and its hot keys, and detaches. With -p it also
+ * prints the counters of every pod, with -t n those of the n pods with the most operations, which
+ * is where to look for a poor hash distribution or a hot key. Operation counts and hot keys are
+ * only kept by stores created with KV_STATS; occupancy, probe lengths and lock waits always are.
+ *
+ * Build: gcc -std=gnu99 -O2 -o kv_stats kv_stats.c main.c -lpthread -lrt
+ * Usage: ./kv_stats [-F] [-p | -t pods] name
+ *        -F: name is the backing file of a file-backed store, not a shared memory object
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "config.h"
+
+struct s_pods {
+    struct kv_pod_stats* pod;
+    unsigned             n;
+    unsigned             size;
+};
+
+unsigned long long pod_ops(const struct kv_pod_stats* p) {
+    return p->writes + p->hits + p->misses;
+}
+
+int cmp_ops(const void* a, const void* b) {
+    unsigned long long x = pod_ops(a), y = pod_ops(b);
+    return x != y ? (x > y ? -1 : 1) : 0;
+}
+
+void collect_pod(const struct kv_pod_stats* p, void* arg) {
+    struct s_pods* pods = arg;
+    if(pods->n == pods->size) {
+        unsigned size = pods->size ? pods->size * 2 : 256;
+        struct kv_pod_stats* t = realloc(pods->pod, size * sizeof(struct kv_pod_stats));
+        if(t == NULL) return;
+        pods->pod  = t;
+        pods->size = size;
+    }
+    pods->pod[pods->n++] = *p;
+}
+
+void print_pod(const struct kv_pod_stats* p) {
+    printf("%u\t%u\t%u\t%u\t%u\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n", p->id, p->entries, p->keys,
+           p->max_chain, p->max_probe, p->writes, p->hits, p->misses, p->evictions, p->expired,
+           p->lock_waits, p->lock_wait_ns);
+}
+
+void print_stats(const struct kv_stats* st) {
+    const struct kv_pod_stats* t = &st->total;
+    unsigned long long reads = t->hits + t->misses;
+    printf("pods\t\t%u\n", st->pods);
+    printf("entries\t\t%u (%.1f per pod)\n", t->entries, st->pods ? (double) t->entries / st->pods : 0.0);
+    printf("keys\t\t%u\n", t->keys);
+    printf("max chain\t%u\n", t->max_chain);
+    printf("max probe\t%u\n", t->max_probe);
+    printf("writes\t\t%llu\n", t->writes);
+    printf("reads\t\t%llu (%.1f%% hits)\n", reads, reads ? 100.0 * t->hits / reads : 0.0);
+    printf("evictions\t%llu\n", t->evictions);
+    printf("expired\t\t%llu\n", t->expired);
+    printf("lock waits\t%llu (%.0f ns average)\n", t->lock_waits, t->lock_waits ? (double) t->lock_wait_ns / t->lock_waits : 0.0);
+    if(st->nhot) {
+        printf("\nhot keys (estimated operations)\n");
+        for(int i = 0; i < st->nhot; i++) printf("%llu\t%s\n", st->hot[i].count, st->hot[i].key);
+    }
+}
+
+// kv_store_open creates what it does not find, so check first that the store is there
+int store_exists(const char* name, int file) {
+    int fd = file ? open(name, O_RDWR) : shm_open(name, O_RDWR, 0);
+    if(fd < 0) return 0;
+    close(fd);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    int c, file = 0, all = 0, top = 0;
+    while((c = getopt(argc, argv, "Fpt:")) != -1) {
+        switch(c) {
+        case 'F': file = 1;             break;
+        case 'p': all  = 1;             break;
+        case 't': top  = atoi(optarg);  break;
+        default:  optind = argc + 1;    break;
+        }
+    }
+    if(optind != argc - 1 || top < 0) {
+        fprintf(stderr, "Usage: %s [-F] [-p | -t pods] name\n", argv[0]);
+        return 1;
+    }
+    const char* name = argv[optind];
+    if(!store_exists(name, file)) {
+        fprintf(stderr, "No store named %s\n", name);
+        return 1;
+    }
+
+    struct kv_options opt = { file ? KV_FILE_BACKED : 0, 0, 0, KV_EVICT_FIFO, KV_NUMA_DEFAULT, 0 };
+    if(kv_store_open(name, &opt)) return 1;
+    struct kv_stats st;
+    struct s_pods   pods = { NULL, 0, 0 };
+    kv_store_stats(&st, all || top ? collect_pod : NULL, &pods);
+    kv_store_close();
+
+    print_stats(&st);
+    if(pods.n) {
+        if(top) qsort(pods.pod, pods.n, sizeof(struct kv_pod_stats), cmp_ops);
+        printf("\npod\tentries\tkeys\tchain\tprobe\twrites\thits\tmisses\tevicted\texpired\twaits\twait_ns\n");
+        for(unsigned i = 0; i < pods.n && (!top || i < (unsigned) top); i++) print_pod(&pods.pod[i]);
+    }
+    free(pods.pod);
+    return 0;
+}
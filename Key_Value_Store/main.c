@@ -4,292 +4,2963 @@
  * It allows for the creation of a key-value store, writing a key-value pair,
  * reading of a key's values one by one, and reading all-values for a key.
  *
+ * Keys hash, through a directory that grows by extendible hashing, to pods of entries; values
+ * live in length-prefixed records of a slab arena at the end of the same segment, which grows
+ * with ftruncate inside a fixed reservation. Entries are only evicted (FIFO, CLOCK or LFU) once
+ * the store cannot grow, and may carry an expiry; deletes leave tombstones for compaction.
+ *
+ * Writers lock their pod with a robust process-shared mutex and repair it if its last owner died.
+ * Readers take no lock: they retry on the pod's seqlock, and pin an epoch while they use records
+ * in place, so records are retired and recycled only once no reader can see them.
+ *
+ * The store lives in shared memory or in a file that is validated or recovered on restart. Stores
+ * may also keep an ordered key index (KV_ORDERED), compress large values (KV_COMPRESS) and count
+ * per-pod statistics (KV_STATS); snapshots stream the store as of their start without stopping
+ * writers.
+ *
  * The file is organized as follows:
  * 1) Basic structures for key-value store defined
  * 2) Miscellaneous functions including hashing function
  * 3) Initialization functions
- * 4) Write functions
- * 5) Read functions
- * 6) Debug functions
- * 7) API functions
+ * 4) Index functions (per-pod key index)
+ * 5) Lock and epoch functions
+ * 6) Mapping functions (huge pages, pre-faulting, NUMA placement)
+ * 7) Compression functions (LZ4-style block codec)
+ * 8) Arena functions (value records)
+ * 9) Snapshot functions (copy-on-write pod images)
+ * 10) Directory functions (pod splitting)
+ * 11) Order functions (ordered key index, prefix scans)
+ * 12) Write functions
+ * 13) Read functions
+ * 14) Update functions (compare-and-swap, increment)
+ * 15) Batch functions
+ * 16) Debug and statistics functions
+ * 17) Persistence functions (backing file, recovery)
+ * 18) API functions
  *
  */
 
+#define _GNU_SOURCE                    // Open file description locks
 #include <stdio.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+#include <time.h>
+#include <linux/magic.h>               // HUGETLBFS_MAGIC
+#include <linux/mempolicy.h>           // MPOL_*, for mbind without libnuma
 #include "config.h"
 
-#define ENTRIES_IN_POD 257
-#define PODS_IN_STORE  257
+// Store geometry. Each can be set at build time (-DENTRIES_IN_POD=256); every unit linked with
+// main.c must use the same values, and a store is refused by binaries built with another geometry.
+// The geometry is fixed per binary: one process cannot open stores of different geometries.
+// KEY_MAX_LENGTH and VALUE_MAX_LENGTH come from config.h, and kv_store_open checks them per caller
+#ifndef ENTRIES_IN_POD
+#define ENTRIES_IN_POD 257             // A power of two turns ring arithmetic into masks
+#endif
+#ifndef INITIAL_DEPTH
+#define INITIAL_DEPTH  8               // The store starts with 1 << INITIAL_DEPTH pods
+#endif
+#ifndef MAX_DEPTH
+#define MAX_DEPTH      16
+#endif
+#define MAX_PODS       (1 << MAX_DEPTH)
+#define POW2_AT_LEAST(n) ((n) <= 64 ? 64 : (n) <= 128 ? 128 : (n) <= 256 ? 256 : (n) <= 512 ? 512 : \
+                          (n) <= 1024 ? 1024 : (n) <= 2048 ? 2048 : (n) <= 4096 ? 4096 : 8192)
+#ifndef INDEX_SLOTS
+#define INDEX_SLOTS    POW2_AT_LEAST(ENTRIES_IN_POD * 3 / 2) // Loaded at most two thirds to keep probes short
+#endif
+#define INDEX_MASK     (INDEX_SLOTS-1)
+#define IS_POW2(n)     (((n) & ((n) - 1)) == 0)
+#define NO_ENTRY       -1
+#define TOMBSTONE      1               // Expiry of deleted and replaced entries: in the past, so they are dropped like expired ones
+#define KEY_WORDS      ((KEY_MAX_LENGTH + 7) / 8)  // Keys are stored zero-padded to whole 64-bit words
+#define CACHE_LINE     64
+
+#define GROW_BYTES     (16 << 20)      // The segment grows in steps of this size
+#define MAX_STORE_BYTES (((size_t) 1 << 32) - GROW_BYTES) // Address space reserved by each process
+#define MIN_BLOCK      16              // Smallest size class, in bytes including the record header
+#define NUM_CLASSES    18              // Size classes MIN_BLOCK << 0 .. MIN_BLOCK << 17 (2 MB)
+#define NO_BLOCK       0
+#define MAX_READERS    256             // Threads that can pin an epoch at the same time
+#define READ_CURSORS   1024            // Slots of each thread's kv_store_read position cache, a power of two
+#define STORE_MAGIC    0x4B565331      // "KVS1"
+#define EVICT_BATCH    16              // Entries a CLOCK or LFU eviction drops at once, sharing one compaction
+#define LFU_SAMPLES    5               // Entries sampled for each LFU victim
+#define LFU_DECAY      (4 * ENTRIES_IN_POD) // LFU read counts are halved after this many evictions from a pod
+#define ORDER_LEVELS   12              // Skip list levels, each holding about a quarter of the keys of the one below
+#define HOT_SAMPLE     64              // One operation in this many is fed to the hot key table
+#define STALL_SPINS    1000            // Yields a reader waits on an odd seqlock before checking that its writer lives
+#define COMPRESS_MIN   128             // KV_COMPRESS leaves shorter values as they are
+#define LZ_MIN_MATCH   4
+#define LZ_HASH_BITS   12              // Match finder table: 4096 positions, 16 KB of stack
+#define LZ_MAX_OFFSET  65535
+#define STORE_VERSION  15              // Bump whenever the shared layout changes
+#define GEOMETRY_WORDS 5
 
 //************************************************************************************
 // Structs
 //************************************************************************************
 
+// Zero-padded key, compared and hashed a word at a time; not NUL-terminated at full length
+union u_key {
+    char     str[KEY_WORDS * 8];
+    uint64_t w[KEY_WORDS];
+};
+
+// Entry metadata; the key is kept apart in the pod's key array, so walking a chain does not load keys
 struct s_entry {
-    char key[KEY_MAX_LENGTH + 1];
-    char val[VALUE_MAX_LENGTH + 1];
+    uint32_t val;                      // Arena offset of the value's record
+    unsigned hash;
+    uint32_t stamp;                    // Pod write counter when written, orders a key's values across splits
+    uint32_t expires;                  // Second (wall clock) the entry expires at, 0 if never
+    int16_t  next;                     // Next (newer) entry with the same key, NO_ENTRY at end of chain
+    uint8_t  hits;                     // Set by readers: reference bit under CLOCK, log-scale read count under LFU
+};
+
+// Index slot: one per distinct key in a pod, found by open addressing (linear probing) over the
+// pod's tag array
+struct s_slot {
+    int16_t head;                      // Oldest entry with the key, NO_ENTRY if the slot is free
+    int16_t tail;                      // Newest entry with the key
 };
 
+// Operation counters, updated with relaxed atomics
+struct s_counters {
+    uint64_t writes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t expired;
+    uint64_t lock_waits;               // Only updated by the writer that then got the lock
+    uint64_t lock_wait_ns;
+    uint32_t max_probe;                // Only updated under the lock
+};
+
+// Laid out by how often each part is touched: the first cache line holds what every read checks,
+// the lock has a line of its own so writers queueing on it do not disturb readers, and a probe
+// reads the dense tag array before any entry. Pods are cache-line aligned (see pod_in_block)
 struct s_pod {
+    atomic_uint seq;                   // Seqlock: odd while a writer is modifying the pod
+    atomic_int begin;
+    atomic_int end;                    // Advanced with release ordering once the entry before it is written
+    uint32_t id;
+    uint32_t depth;                    // Local depth: all keys in the pod share their low depth hash bits
+    uint32_t prefix;                   // ... which are these
+    uint32_t stamp;                    // Last stamp given to an entry
+    uint32_t expiry;                   // No entry expires before this, 0 if none expires
+    uint32_t hand;                     // CLOCK: ring offset the next eviction sweep starts at
+    uint32_t aged;                     // LFU: entries evicted since read counts were last halved
+    uint32_t snap;                     // Generation of the last snapshot the pod was copied for
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;  // Serializes writers, robust and process-shared
+    _Alignas(CACHE_LINE) uint8_t tag[INDEX_SLOTS];  // Top byte of the key hash, never 0; 0 if the slot is free
+    struct s_slot  index[INDEX_SLOTS];
     struct s_entry entry[ENTRIES_IN_POD];
-    int begin;
-    int end;
+    union u_key    key[ENTRIES_IN_POD]; // Key of each entry, only compared once a tag matches
+    _Alignas(CACHE_LINE) struct s_counters stats;  // Apart, so counting reads does not disturb the lines above
+};
+
+// Length-prefixed value record; while on a free list, data holds the next free block's offset
+struct s_record {
+    uint32_t len    : 26;              // Of data, compressed or not
+    uint32_t cls    : 5;               // Size class of the block holding the record
+    uint32_t packed : 1;               // Set if data holds the value's length and then its compressed bytes
+    uint32_t owner;                    // owner_tag of the entry linking the record, 0 until linked
+    char     data[];
+};
+
+struct s_arena {
+    pthread_mutex_t lock;
+    uint32_t top;                      // Offset of the first never-allocated byte
+    uint32_t limit;                    // Current size of the segment
+    uint32_t free_list[NUM_CLASSES];
+    uint32_t retired;                  // Ring of (record, epoch) pairs waiting for readers to leave their epoch
+    uint32_t retire_begin;             // Free-running indexes of the oldest pair and one past the newest,
+    uint32_t retire_end;               // each advanced by one store: a dead lock holder leaks at worst
+};
+
+// Skip list node of the ordered key index, in an arena block
+struct s_node {
+    union u_key key;
+    uint32_t    height;
+    atomic_uint next[];                // Arena offset of the next node at each level, NO_BLOCK at the end
+};
+
+// Hot key table entry; count 0 if unused
+struct s_hot {
+    union u_key key;
+    uint64_t    count;
+};
+
+struct s_reader {
+    atomic_int  tid;                   // Owning thread, 0 if the slot is free
+    atomic_uint epoch;                 // Pinned epoch, 0 while the thread is not reading in place
+};
+
+// Position in a key's value history: the last entry read, found again in O(1) by pod, slot and stamp
+struct kv_cursor {
+    union u_key key;
+    unsigned    hash;
+    uint32_t    pod;
+    int         entry;                 // NO_ENTRY before the first read
+    uint32_t    stamp;
 };
 
 struct s_store {
-    struct s_pod pod[PODS_IN_STORE];
+    uint32_t        magic;             // STORE_MAGIC once the store is initialized
+    uint32_t        version;
+    uint32_t        geometry[GEOMETRY_WORDS]; // store_geometry of the binary that created the store
+    uint32_t        policy;            // KV_EVICT_*, fixed when the store is created
+    uint32_t        ordered;           // Keeps an ordered key index, fixed when the store is created
+    uint32_t        stats;             // Counts operations and samples hot keys, fixed when the store is created
+    uint32_t        compress;          // Compresses large values, fixed when the store is created
+    uint32_t        order;             // Arena offset of the index's head node, NO_BLOCK until it is built
+    atomic_uint     clean;             // Set by the last process to close the store, after syncing it
+    uint32_t        checksum;          // Of the header, valid while clean
+    struct s_arena  arena;
+    pthread_mutex_t dir_lock;          // Serializes pod splits and directory doubling
+    uint32_t        split_pod;         // Pod being split, MAX_PODS if none, so a split whose owner died is finished
+    uint32_t        split_id;          // ... and the ID its new pod gets
+    pthread_mutex_t order_lock;        // Serializes changes to the ordered key index
+    pthread_mutex_t hot_lock;          // Serializes changes to the hot key table
+    struct s_hot    hot[KV_HOT_KEYS];
+    atomic_uint     depth;             // Global depth: the directory is indexed by the low depth bits of a hash
+    atomic_uint     npods;
+    uint32_t        pod[MAX_PODS];     // Pod ID -> arena offset of the pod
+    atomic_uint     dir[MAX_PODS];     // Directory slot -> pod ID
+    atomic_uint     epoch;             // Advanced each time a record is retired; wraps, see epoch_before
+    atomic_uint     snap;              // Generation of the running snapshot, 0 if none
+    atomic_int      snap_owner;        // Thread taking the snapshot, 0 if none
+    uint32_t        snap_gen;          // Last generation handed out
+    uint32_t        snap_pods;         // Pods when the running snapshot started; pods split off later are skipped
+    uint32_t        snap_table;        // Arena block mapping those pods to the copies writers saved, NO_BLOCK if none
+    uint32_t        snap_torn;         // Set if a copy could not be saved: the snapshot is not consistent
+    struct s_reader reader[MAX_READERS];
 };
 
-int last_read_pod[PODS_IN_STORE]; // Keeps track of the last read entry in each pod
-struct s_store store;
-struct s_store* mm_store;
+#define ARENA_START ((sizeof(struct s_store) + 63) & ~(size_t) 63)
+
+_Static_assert(ENTRIES_IN_POD >= EVICT_BATCH && ENTRIES_IN_POD <= INT16_MAX, "entries are indexed by int16_t");
+_Static_assert(IS_POW2(INDEX_SLOTS) && INDEX_SLOTS > ENTRIES_IN_POD, "the index needs a free slot to end probes");
+_Static_assert(INITIAL_DEPTH <= MAX_DEPTH && ((uint64_t) INDEX_SLOTS << MAX_DEPTH) <= ((uint64_t) 1 << 32),
+               "directory and index bits must fit in the 32-bit hash");
+_Static_assert(IS_POW2(READ_CURSORS), "the position cache is indexed by hash bits");
+_Static_assert(KEY_MAX_LENGTH > 0, "keys need at least one character");
+_Static_assert(sizeof(struct s_record) + VALUE_MAX_LENGTH + 1 <= MIN_BLOCK << (NUM_CLASSES-1) &&
+               CACHE_LINE + sizeof(struct s_pod) <= MIN_BLOCK << (NUM_CLASSES-1), "records and pods must fit the largest size class");
+_Static_assert(NUM_CLASSES <= 32 && (MIN_BLOCK << (NUM_CLASSES-1)) < (1 << 26), "record header fields are too narrow");
 
-sem_t* sem[PODS_IN_STORE]; //Semaphore for each pod
+// Background thread calling fn on the open store every ms milliseconds until stopped
+struct s_task {
+    pthread_t    thread;
+    volatile int run;
+    unsigned     ms;
+    void       (*fn)(struct s_store*);
+};
+
+struct s_store* mm_store;
+const uint32_t store_geometry[GEOMETRY_WORDS] = { ENTRIES_IN_POD, INDEX_SLOTS, MAX_DEPTH, KEY_MAX_LENGTH, VALUE_MAX_LENGTH };
+int    store_fd = -1;              // Kept open so any process can grow the segment
+int    store_file;                 // Store lives in a regular file rather than shared memory
 char*  db_name;
+unsigned store_gen;                // Incremented by every open, invalidates reader slots and read positions of old opens
+size_t store_align;                // The segment's size is kept a multiple of its page size
+int    store_populate;             // Pre-fault the segment as it grows (KV_POPULATE)
+
+struct s_task checkpointer;        // Optional background threads of this process
+struct s_task sweeper;
+
+__thread int      reader_slot = -1; // This thread's slot in mm_store->reader, claimed on first use
+__thread unsigned reader_gen;
+__thread int      pin_depth;       // Nested epoch_pin calls, from callbacks of the view, scan and snapshot API
+__thread uint64_t rand_state;      // Eviction sampling and LFU counting, seeded on first use
+
+__thread struct kv_cursor read_cursor[READ_CURSORS]; // Where this thread's kv_store_read left off, by key hash
+__thread unsigned         cursor_gen;      // store_gen of the open read_cursor refers to
 
 //************************************************************************************
 // Miscellaneous Functions
 //************************************************************************************
 
-unsigned hash(const char* str) {
-    //Adapted from Dan Bernstein in comp.lang.c
-    unsigned long h = 5381;
-    int c;
+// 64x64->128 bit multiply, folded: the mixing step of wyhash
+uint64_t mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+// Adapted from wyhash, over the padded key two words at a time
+unsigned hash(const union u_key* k) {
+    const uint64_t p0 = 0xa0761d6478bd642full, p1 = 0xe7037ed1a0b428dbull, p2 = 0x8ebc6af09c88c6e3ull;
+    uint64_t h = p0;
+    int i = 0;
+    for(; i + 1 < KEY_WORDS; i += 2) h = mix(k->w[i] ^ p1, k->w[i+1] ^ h);
+    if(i < KEY_WORDS) h = mix(k->w[i] ^ p1, h);
+    h = mix(h ^ p2, p1);
+    return (unsigned) (h ^ (h >> 32));
+}
+
+// Pads key into k and returns its hash; done once per operation, the rest works on k
+unsigned pack_key(union u_key* k, const char* key) {
+    memset(k, 0, sizeof(*k));
+    memcpy(k->str, key, strnlen(key, KEY_MAX_LENGTH));
+    return hash(k);
+}
+
+// Tags a record with the entry linking it, by the key's hash and the entry's stamp, so recovery
+// can tell a record from another one later written to the same block; never 0, the untagged mark
+uint32_t owner_tag(unsigned h, uint32_t stamp) {
+    uint64_t t = mix((uint64_t) h << 32 | stamp, 0xa0761d6478bd642full);
+    return (uint32_t) (t ^ (t >> 32)) | 1;
+}
+
+int same_key(const union u_key* a, const union u_key* b) {
+    uint64_t d = 0;
+    for(int i = 0; i < KEY_WORDS; i++) d |= a->w[i] ^ b->w[i];
+    return d == 0;
+}
+
+uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Expiry uses the wall clock, which unlike the monotonic one carries over a reboot of a file store
+uint32_t now_sec(void) {
+    return (uint32_t) time(NULL);
+}
+
+int expired(const struct s_entry* e, uint32_t now) {
+    return e->expires != 0 && e->expires <= now;
+}
+
+// xorshift64*: cheap and good enough to pick eviction samples
+uint32_t fast_rand(void) {
+    if(rand_state == 0) rand_state = (uint64_t) syscall(SYS_gettid) * 0x9E3779B97F4A7C15ull | 1;
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return (uint32_t) ((rand_state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+uint8_t entry_hits(const struct s_entry* e) {
+    return __atomic_load_n(&e->hits, __ATOMIC_RELAXED);
+}
+
+// Notes a read of e for the eviction policy. Readers race with each other and with writers, so
+// this is a relaxed store that at worst loses a count; it only writes when the value changes,
+// so hot entries' cache lines are not bounced between readers. LFU counts are log-scale: the
+// n-th increment happens with probability 1/n, so a byte covers some 30000 reads
+void touch_entry(const struct s_store* s, struct s_entry* e) {
+    uint8_t n = entry_hits(e);
+    if(s->policy == KV_EVICT_CLOCK) {
+        if(n == 0) __atomic_store_n(&e->hits, 1, __ATOMIC_RELAXED);
+    }
+    else if(s->policy == KV_EVICT_LFU) {
+        if(n < UINT8_MAX && fast_rand() % (n+1) == 0) __atomic_store_n(&e->hits, n+1, __ATOMIC_RELAXED);
+    }
+}
+
+// Adds n to a pod counter of a store keeping statistics
+void count_op(const struct s_store* s, uint64_t* counter, uint64_t n) {
+    if(s->stats && n) __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
 
-    while(c = *str++) h = ((h << 5) + h) + c; // Hash * 33 + c;
-    return (unsigned) h;
+// Feeds one operation on key in HOT_SAMPLE to the hot key table, space-saving style: a key not
+// in the table takes the place of the least counted one, inheriting its count. Sampling is
+// skipped rather than waited for while another thread holds the table
+void sample_key(struct s_store* s, const union u_key* key) {
+    if(!s->stats || fast_rand() % HOT_SAMPLE) return;
+    int status = pthread_mutex_trylock(&s->hot_lock);
+    if(status == EOWNERDEAD) status = pthread_mutex_consistent(&s->hot_lock);
+    if(status) return;
+    int min = 0;
+    for(int i = 0; i < KV_HOT_KEYS; i++) {
+        if(s->hot[i].count && same_key(&s->hot[i].key, key)) {
+            min = i;
+            break;
+        }
+        if(s->hot[i].count < s->hot[min].count) min = i;
+    }
+    if(!same_key(&s->hot[min].key, key)) s->hot[min].key = *key;
+    s->hot[min].count += HOT_SAMPLE;
+    pthread_mutex_unlock(&s->hot_lock);
 }
 
+// Wraps i, in [0, 2 * ENTRIES_IN_POD), onto the ring: a mask or a compare, never a division
+int wrap_pod_index(int i) {
+    if(IS_POW2(ENTRIES_IN_POD)) return i & (ENTRIES_IN_POD - 1);
+    return i >= ENTRIES_IN_POD ? i - ENTRIES_IN_POD : i;
+}
 
 int inc_pod_index(int i) {
-    return (i+1)%ENTRIES_IN_POD;
+    return wrap_pod_index(i+1);
 }
 
-int my_sem_wait(int podID) {
-    int status = sem_wait(sem[podID]);
-    if(status == -1) printf("Sem_wait failed - pod: %d\n", podID);
-    return status;
+int ring_offset(const struct s_pod* p, int i) {
+    return wrap_pod_index(i - p->begin + ENTRIES_IN_POD);
 }
 
-int my_sem_post(int podID) {
-    int status = sem_post(sem[podID]);
-    if(status == -1) printf("Sem_post failed - pod: %d\n", podID);
-    return status;
+// 0 marks a free slot, so it is never a tag
+uint8_t hash_tag(unsigned h) {
+    uint8_t t = (uint8_t) (h >> 24);
+    return t ? t : 1;
+}
+
+int hash_slot(unsigned h) {
+    return (int) (h >> MAX_DEPTH) & INDEX_MASK;  // Bits never used by the directory
+}
+
+// Pods live in arena blocks, at the first cache line boundary past the block header, so no two
+// pods share a line
+struct s_pod* pod_in_block(struct s_store* s, uint32_t off) {
+    return (struct s_pod*) ((char*) s + ((off + sizeof(struct s_record) + CACHE_LINE - 1) & ~(uint32_t) (CACHE_LINE - 1)));
+}
+
+struct s_pod* pod_at(struct s_store* s, uint32_t id) {
+    return pod_in_block(s, s->pod[id]);
+}
+
+// Lock-free directory lookup; callers recheck it once they hold or have validated the pod
+struct s_pod* find_pod(struct s_store* s, unsigned h) {
+    unsigned depth = atomic_load_explicit(&s->depth, memory_order_acquire);
+    unsigned id    = atomic_load_explicit(&s->dir[h & ((1u << depth) - 1)], memory_order_acquire);
+    return pod_at(s, id);
+}
+
+// Doubles the directory: the upper half starts as a copy of the lower one
+void double_dir(struct s_store* s, unsigned depth) {
+    for(unsigned i = 0; i < (1u << depth); i++) {
+        atomic_store_explicit(&s->dir[i + (1u << depth)], atomic_load(&s->dir[i]), memory_order_relaxed);
+    }
+    atomic_store_explicit(&s->depth, depth+1, memory_order_release);
+}
+
+int pod_full(const struct s_pod* p) {
+    return inc_pod_index(p->end) == p->begin;
+}
+
+void note_expiry(struct s_pod* p, uint32_t expires) {
+    if(expires != 0 && (p->expiry == 0 || expires < p->expiry)) p->expiry = expires;
+}
+
+// Writers hold the pod lock and bracket their changes so lock-free readers can detect them
+void write_begin(struct s_pod* p) {
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void write_end(struct s_pod* p) {
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_release);
+}
+
+
+void* task_loop(void* arg) {
+    struct s_task* t = arg;
+    while(t->run) {
+        for(unsigned ms = 0; ms < t->ms && t->run; ms += 10) usleep(10000);
+        if(t->run) t->fn(mm_store);
+    }
+    return NULL;
+}
+
+void start_task(struct s_task* t, unsigned ms, void (*fn)(struct s_store*)) {
+    t->ms  = ms;
+    t->fn  = fn;
+    t->run = 1;
+    if(pthread_create(&t->thread, NULL, task_loop, t)) t->run = 0;
+}
+
+void stop_task(struct s_task* t) {
+    if(!t->run) return;
+    t->run = 0;
+    pthread_join(t->thread, NULL);
 }
 
 
 //************************************************************************************
 // Init Functions
 //************************************************************************************
-void init_entry(struct s_entry* e) {
-    for(size_t i = 0; i < sizeof(e->key); i++) e->key[i] = 0;
-    for(size_t i = 0; i < sizeof(e->val); i++) e->val[i] = 0;
+void init_entry(struct s_pod* p, int e) {
+    memset(&p->key[e], 0, sizeof(p->key[e]));
+    p->entry[e].val = NO_BLOCK;
+}
+
+void init_slot(struct s_pod* p, int i) {
+    p->tag[i]        = 0;
+    p->index[i].head = NO_ENTRY;
+    p->index[i].tail = NO_ENTRY;
 }
 
 void init_pod(struct s_pod* p) {
-    for(int i = 0; i < ENTRIES_IN_POD; i++) init_entry(&p->entry[i]);
-    p->begin = 0;
-    p->end   = 0;
-}
-
-void init_store(struct s_store* s) {
-    for(int i = 0; i < PODS_IN_STORE; i++) init_pod(&s->pod[i]);
-}
-
-void init_sem(void) {
-    char semNames[50] = "";
-    for(int i = 0; i < PODS_IN_STORE; i++) {
-        sprintf(semNames, "mySemaphore_%d", i);
-        sem[i] = sem_open(semNames, O_CREAT, S_IRWXU, 1);
-        if(sem[i] == SEM_FAILED) {
-            printf("Creating semaphore failed\n");
-            for(int j = 0; j < i; j++) {
-                sprintf(semNames, "mySemaphore_%d", j);
-                sem_unlink(semNames);
-                sem_close(sem[j]);
-            }
-            exit(1);
-        }
+    for(int i = 0; i < INDEX_SLOTS; i++)    init_slot(p, i);
+    for(int i = 0; i < ENTRIES_IN_POD; i++) init_entry(p, i);
+    atomic_init(&p->begin, 0);
+    atomic_init(&p->end, 0);
+    p->stamp  = 0;
+    p->expiry = 0;
+    p->hand   = 0;
+    p->aged   = 0;
+    p->snap   = 0;
+    memset(&p->stats, 0, sizeof(p->stats));
+    atomic_init(&p->seq, 0);
+}
+
+int init_lock(pthread_mutex_t* m) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int status = pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return status;
+}
+
+int init_arena(struct s_arena* a) {
+    a->top     = ARENA_START;
+    a->limit   = ARENA_START;
+    a->retired  = NO_BLOCK;
+    a->retire_begin = a->retire_end = 0;
+    for(int c = 0; c < NUM_CLASSES; c++) a->free_list[c] = NO_BLOCK;
+    return init_lock(&a->lock);
+}
+
+//************************************************************************************
+// Index Functions
+//************************************************************************************
+
+// Returns the index slot holding key, or NO_ENTRY
+// Probes are bounded since lock-free readers may observe the index mid-update
+int index_find(const struct s_pod* p, const union u_key* key, unsigned h) {
+    uint8_t tag = hash_tag(h);
+    int i = hash_slot(h);
+    for(int n = 0; n < INDEX_SLOTS && p->tag[i] != 0; n++, i = (i+1) & INDEX_MASK) {
+        if(p->tag[i] != tag) continue;
+        int e = p->index[i].head;
+        if(e == NO_ENTRY) continue;                       // Being linked: not there yet
+        if(p->entry[e].hash == h && same_key(&p->key[e], key)) return i;
+    }
+    return NO_ENTRY;
+}
+
+// Returns the free slot where a key with hash h would be inserted
+int index_free_slot(const struct s_pod* p, unsigned h) {
+    int i = hash_slot(h);
+    while(p->tag[i] != 0) i = (i+1) & INDEX_MASK;
+    return i;
+}
+
+// Backward-shift deletion: keeps every probe sequence gap-free without tombstones
+void index_remove(struct s_pod* p, int i) {
+    int j = i;
+    for(;;) {
+        j = (j+1) & INDEX_MASK;
+        if(p->tag[j] == 0) break;
+        int home = hash_slot(p->entry[p->index[j].head].hash);
+        // Move j into the hole unless its home lies cyclically in (i, j]
+        if(i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+        p->tag[i]   = p->tag[j];
+        p->index[i] = p->index[j];
+        i = j;
+    }
+    init_slot(p, i);
+}
+
+// Unlinks the oldest entry of the pod, which is the head of its key's chain unless it is a
+// tombstone no chain links to. Returns the entry's value record for the caller to free once the
+// pod is consistent again
+uint32_t evict_oldest(struct s_pod* p) {
+    struct s_entry* e = &p->entry[p->begin];
+    int i = index_find(p, &p->key[p->begin], e->hash);
+    if(i != NO_ENTRY && p->index[i].head == p->begin) {
+        p->index[i].head = e->next;
+        if(e->next == NO_ENTRY) index_remove(p, i);
+    }
+    p->begin = inc_pod_index(p->begin);
+    return e->val;
+}
+
+// Appends the already written entry e to the chain of its key. The entry and a new slot's tag
+// are complete before the store that makes them reachable, so appends need no seqlock; readers
+// only follow head and next to entries, which orders their loads after these stores
+void link_entry(struct s_pod* p, int e) {
+    struct s_entry* en = &p->entry[e];
+    en->next = NO_ENTRY;
+    int slot = index_find(p, &p->key[e], en->hash);
+    if(slot == NO_ENTRY) {
+        slot = index_free_slot(p, en->hash);
+        uint32_t probe = ((slot - hash_slot(en->hash)) & INDEX_MASK) + 1;
+        if(probe > p->stats.max_probe) p->stats.max_probe = probe;
+        p->index[slot].tail = e;
+        p->tag[slot]        = hash_tag(en->hash);
+        atomic_thread_fence(memory_order_release);
+        p->index[slot].head = e;
+    }
+    else {
+        atomic_thread_fence(memory_order_release);
+        p->entry[p->index[slot].tail].next = e;
+        p->index[slot].tail = e;
     }
 }
 
-void close_sem(void) {
-    char semNames[50] = "";
-    for(int i = 0; i < PODS_IN_STORE; i++) {
-        sprintf(semNames, "mySemaphore_%d", i);
-        sem_unlink(semNames);
-        sem_close(sem[i]);
+// Relinks every entry between begin and end, discarding whatever state the index was left in.
+// Tombstones stay out of the chains, as when they were made, until compaction drops them
+void rebuild_pod(struct s_pod* p) {
+    for(int i = 0; i < INDEX_SLOTS; i++) init_slot(p, i);
+    for(int e = p->begin; e != p->end; e = inc_pod_index(e)) {
+        if(p->entry[e].expires != TOMBSTONE) link_entry(p, e);
     }
 }
 
+// Copies entry e of pod q, with its key, into entry d of p
+void copy_entry(struct s_pod* p, int d, const struct s_pod* q, int e) {
+    p->entry[d] = q->entry[e];
+    p->key[d]   = q->key[e];
+}
+
+// Appends a copy of entry e of q to p, linked unless it is a tombstone
+void append_entry(struct s_pod* p, const struct s_pod* q, int e) {
+    int d = p->end;
+    copy_entry(p, d, q, e);
+    atomic_store_explicit(&p->end, inc_pod_index(d), memory_order_release);
+    if(p->entry[d].expires != TOMBSTONE) link_entry(p, d);
+}
+
 //************************************************************************************
-// Write Functions
+// Lock Functions
 //************************************************************************************
 
-void write_entry(struct s_entry* s, const char* key, const char* val) {
-    strncpy(&s->key[0], key, KEY_MAX_LENGTH);
-    strncpy(&s->val[0], val, VALUE_MAX_LENGTH);
+// Settles the split recorded in the header, whose owner died: finished if the new pod was
+// published, else abandoned, its block leaking until the next recovery. The split pod's own
+// entries are left to recover_pod, run by whoever next takes its lock
+void finish_split(struct s_store* s) {
+    uint32_t from = __atomic_load_n(&s->split_pod, __ATOMIC_ACQUIRE);
+    if(from == MAX_PODS) return;
+    uint32_t id = s->split_id;
+    if(atomic_load(&s->npods) > id) {
+        struct s_pod* q = pod_at(s, id);
+        unsigned depth = atomic_load(&s->depth);
+        if(q->depth > depth) double_dir(s, depth++);
+        for(unsigned i = q->prefix; i < (1u << depth); i += 1u << q->depth) {
+            atomic_store_explicit(&s->dir[i], id, memory_order_release);
+        }
+        pod_at(s, from)->depth = q->depth;
+    }
+    __atomic_store_n(&s->split_pod, MAX_PODS, __ATOMIC_RELEASE);
+}
+
+int lock_dir(struct s_store* s) {
+    int status = pthread_mutex_lock(&s->dir_lock);
+    if(status == EOWNERDEAD) {
+        finish_split(s);
+        status = pthread_mutex_consistent(&s->dir_lock);
+    }
+    if(status) printf("Directory lock failed\n");
+    return status;
 }
 
-int write_pod(struct s_pod* p, const char* key, const char* val) {
-    int found = 0;
-    for(int i = p->begin; i != p->end; i = inc_pod_index(i)) {
-        if(!strncmp(key, p->entry[i].key, KEY_MAX_LENGTH) &&
-           !strncmp(val, p->entry[i].val, VALUE_MAX_LENGTH)) {
-            found = 1;
-            break;
+// Repairs the locked pod p after its writer died with the update half done. A compaction cut
+// short leaves entries both moved and in their old place, so each record is kept once, in ring
+// order, and only if the pod still owns its hash: entries it meant to drop come back, their records
+// not retired yet. A split of p is settled first, under the directory lock. Safe to repeat
+void recover_pod(struct s_store* s, struct s_pod* p) {
+    printf("Recovering pod %u from dead lock owner\n", p->id);
+    if(lock_dir(s) == 0) pthread_mutex_unlock(&s->dir_lock);
+    if(!(atomic_load(&p->seq) & 1)) write_begin(p);      // It may have died outside a seqlock section
+    uint32_t mask = (1u << p->depth) - 1;
+    int w = p->begin;
+    p->expiry = 0;
+    for(int e = p->begin; e != p->end; e = inc_pod_index(e)) {
+        int dup = 0;
+        for(int k = p->begin; k != w && !dup; k = inc_pod_index(k)) dup = p->entry[k].val == p->entry[e].val;
+        if(dup || (p->entry[e].hash & mask) != p->prefix) continue;
+        note_expiry(p, p->entry[e].expires);
+        if(w != e) copy_entry(p, w, p, e);
+        w = inc_pod_index(w);
+    }
+    p->end = w;
+    rebuild_pod(p);
+    write_end(p);
+}
+
+// Time spent waiting is only measured when the lock is found taken
+int lock_pod(struct s_store* s, struct s_pod* p) {
+    int status = pthread_mutex_trylock(&p->lock);
+    if(status == EBUSY) {
+        uint64_t t = clock_ns();
+        status = pthread_mutex_lock(&p->lock);
+        p->stats.lock_waits++;
+        p->stats.lock_wait_ns += clock_ns() - t;
+    }
+    if(status == EOWNERDEAD) {
+        recover_pod(s, p);
+        status = pthread_mutex_consistent(&p->lock);
+    }
+    if(status) printf("Pod lock failed - pod: %u\n", p->id);
+    return status;
+}
+
+// Called by a reader that has long seen p's seqlock odd. A live writer keeps the lock; if the
+// writer died instead, nobody else may come to repair the pod, so the reader does
+void check_writer(struct s_store* s, struct s_pod* p) {
+    int status = pthread_mutex_trylock(&p->lock);
+    if(status != 0 && status != EOWNERDEAD) return;
+    if(status == EOWNERDEAD || atomic_load(&p->seq) & 1) recover_pod(s, p);
+    if(status == EOWNERDEAD) pthread_mutex_consistent(&p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Readers retry if a writer bracketed a change since read_begin, and wait out one in progress
+unsigned read_begin(struct s_store* s, struct s_pod* p) {
+    unsigned seq;
+    for(int n = 1; (seq = atomic_load_explicit(&p->seq, memory_order_acquire)) & 1; n++) {
+        if(n % STALL_SPINS == 0) check_writer(s, p);
+        sched_yield();
+    }
+    return seq;
+}
+
+int read_retry(struct s_pod* p, unsigned seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&p->seq, memory_order_relaxed) != seq;
+}
+
+int unlock_pod(struct s_pod* p) {
+    int status = pthread_mutex_unlock(&p->lock);
+    if(status) printf("Pod unlock failed - pod: %u\n", p->id);
+    return status;
+}
+
+// Taken with a pod lock held. A writer dying mid-change leaves the skip list usable: nodes are
+// linked bottom-up and unlinked top-down, so at worst a stale node stays until recovery
+int lock_order(struct s_store* s) {
+    int status = pthread_mutex_lock(&s->order_lock);
+    if(status == EOWNERDEAD) status = pthread_mutex_consistent(&s->order_lock);
+    if(status) printf("Order lock failed\n");
+    return status;
+}
+
+int lock_arena(struct s_arena* a) {
+    int status = pthread_mutex_lock(&a->lock);
+    // Every change under this lock is published by one store after the data it links, so a holder
+    // dying anywhere leaves the arena consistent, at worst leaking the block it was moving
+    if(status == EOWNERDEAD) status = pthread_mutex_consistent(&a->lock);
+    if(status) printf("Arena lock failed\n");
+    return status;
+}
+
+//************************************************************************************
+// Epoch Functions
+//************************************************************************************
+
+int claim_reader(struct s_store* s) {
+    int tid = (int) syscall(SYS_gettid);
+    for(int i = 0; i < MAX_READERS; i++) {
+        int free_slot = 0;
+        if(atomic_compare_exchange_strong(&s->reader[i].tid, &free_slot, tid)) return i;
+    }
+    // Threads never give their slot back, so take over one whose thread is gone
+    for(int i = 0; i < MAX_READERS; i++) {
+        int old = atomic_load(&s->reader[i].tid);
+        if(old != 0 && kill(old, 0) == -1 && errno == ESRCH &&
+           atomic_compare_exchange_strong(&s->reader[i].tid, &old, tid)) {
+            atomic_store(&s->reader[i].epoch, 0);
+            return i;
         }
     }
+    return -1;
+}
+
+// Pins the current epoch for this thread; records it can reach stay valid until epoch_unpin.
+// Pins nest: an inner one keeps the outer, older epoch, which protects everything it can reach
+int epoch_pin(struct s_store* s) {
+    if(reader_gen != store_gen) reader_slot = -1, pin_depth = 0;
+    reader_gen = store_gen;
+    if(pin_depth > 0) {
+        pin_depth++;
+        return 0;
+    }
+    if(reader_slot < 0 && (reader_slot = claim_reader(s)) < 0) {
+        printf("No free reader slot\n");
+        return 1;
+    }
+    unsigned e = atomic_load(&s->epoch);
+    atomic_store(&s->reader[reader_slot].epoch, e != 0 ? e : e - 1);  // 0 would read as idle: pin the one before
+    pin_depth = 1;
+    return 0;
+}
+
+void epoch_unpin(struct s_store* s) {
+    if(--pin_depth == 0) atomic_store_explicit(&s->reader[reader_slot].epoch, 0, memory_order_release);
+}
 
-    if(!found) {
-        write_entry(&p->entry[p->end], key, val);
-        p->end = inc_pod_index(p->end);
+// Epochs wrap around: a is before b if it is less than half the counter behind it. Pins and
+// pending retirements are never that far apart
+int epoch_before(unsigned a, unsigned b) {
+    return (int32_t) (a - b) < 0;
+}
 
-        if(p->begin == p->end) p->begin = inc_pod_index(p->begin);
+// Oldest epoch still pinned, or the current one if none is; epochs left pinned by dead threads
+// are skipped, their slots are left for claim_reader to take over
+unsigned min_pinned(struct s_store* s) {
+    unsigned min = atomic_load(&s->epoch);
+    for(int i = 0; i < MAX_READERS; i++) {
+        unsigned e = atomic_load(&s->reader[i].epoch);
+        if(e == 0 || !epoch_before(e, min)) continue;
+        int tid = atomic_load(&s->reader[i].tid);
+        if(tid != 0 && kill(tid, 0) == -1 && errno == ESRCH) continue;
+        min = e;
     }
-    return found;
+    return min;
 }
 
-int write_store(struct s_store* s, const char* key, const char* val) {
-    if(key == NULL || val == NULL) return 1;
-    int podID = hash(key) % PODS_IN_STORE;
-    if(my_sem_wait(podID) == -1) return 1;
-    int res = write_pod(&s->pod[podID], key, val);
-    my_sem_post(podID);
-    return res;
+// A forked child inherits the parent's thread-local slot index but must not share its slot,
+// and may inherit tasks run by threads that do not exist in it
+void reset_child(void) {
+    reader_slot = -1;
+    pin_depth   = 0;
+    checkpointer.run = 0;
+    sweeper.run      = 0;
 }
 
 //************************************************************************************
-// Read Functions
+// Mapping Functions
 //************************************************************************************
 
-char* read_entry(struct s_entry* s) {
-    char* c = calloc(VALUE_MAX_LENGTH+1, sizeof(char));
-    strncpy(c, s->val, VALUE_MAX_LENGTH);
-    return c;
+// Rounds a segment size up to whole pages, which hugetlbfs requires of ftruncate
+size_t align_segment(size_t bytes) {
+    return (bytes + store_align - 1) / store_align * store_align;
 }
 
-char* read_pod(struct s_pod* p, const char* key, const int podID) {
-    if(p->begin == p->end) return NULL; // Return if pod empty
+// Faults in the pages covering [from, to) writable, so accesses to them take no page fault.
+// Returns 1 if that fails, which on hugetlbfs means the huge page pool ran out
+int populate_segment(struct s_store* s, size_t from, size_t to) {
+    from &= ~(store_align - 1);
+    if(!store_populate || to <= from) return 0;
+    if(madvise((char*) s + from, to - from, MADV_POPULATE_WRITE)) {
+        printf("Failed to pre-fault the store\n");
+        return 1;
+    }
+    return 0;
+}
 
-    int current = last_read_pod[podID];
+// Applies the page options of opt to the address reservation at addr before anything in it is
+// touched. Transparent huge pages are a hint: shared memory only gets them if the kernel allows
+// it (shmem_enabled), so their absence is reported but not an error
+int map_segment(char* addr, int fd, const struct kv_options* opt) {
+    struct statfs fs;
+    store_align    = (size_t) sysconf(_SC_PAGESIZE);
+    store_populate = opt != NULL && (opt->flags & KV_POPULATE);
+    if(fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC) store_align = (size_t) fs.f_bsize;
+    if(opt == NULL) return 0;
 
-    for(int i = 0; i < ENTRIES_IN_POD; i++) {
-        if(current == p->end) current = p->begin;
-        if(p->entry[current].key == NULL) break;
-        if(!strncmp(p->entry[current].key, key, KEY_MAX_LENGTH)) {
-            char* val            = read_entry(&p->entry[current]);
-            current              = inc_pod_index(current);
-            last_read_pod[podID] = current;
-            return val;
+    if((opt->flags & KV_HUGE_PAGES) && store_align == (size_t) sysconf(_SC_PAGESIZE) &&
+       madvise(addr, MAX_STORE_BYTES, MADV_HUGEPAGE)) printf("Transparent huge pages not available\n");
+    if(opt->numa != KV_NUMA_DEFAULT) {
+        int mode = opt->numa == KV_NUMA_INTERLEAVE ? MPOL_INTERLEAVE : MPOL_BIND;
+        if(syscall(SYS_mbind, addr, MAX_STORE_BYTES, mode, &opt->numa_nodes, sizeof(opt->numa_nodes) * 8 + 1, 0)) {
+            printf("Failed to set NUMA policy\n");
+            return 1;
         }
-        current = inc_pod_index(current);
     }
-    return NULL;                                      // None found
+    return 0;
+}
+
+//************************************************************************************
+// Compression Functions
+//************************************************************************************
+
+// LZ4-style blocks: each sequence is a token holding the literal count in its high nibble and the
+// match length less LZ_MIN_MATCH in its low one, 15 meaning that bytes adding up to 255 each
+// follow, then the literals, then the match's offset back as 16 bits little-endian. The last
+// sequence has literals only. Matches are found greedily through a table of 4-byte prefixes
+
+uint32_t lz_hash(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Appends what a length of n, 15 or more, adds to its nibble; NULL if it does not fit before end
+uint8_t* lz_put_length(uint8_t* o, const uint8_t* end, size_t n) {
+    for(n -= 15; o != end; n -= 255) {
+        *o++ = n < 255 ? (uint8_t) n : 255;
+        if(n < 255) return o;
+    }
+    return NULL;
 }
 
-char* read_store(struct s_store* s, const char* key) {
-    if(key == NULL) return NULL;
-    int podID = hash(key) % PODS_IN_STORE;
-    if(my_sem_wait(podID) == -1) return NULL;
-    char* val = read_pod(&s->pod[podID], key, podID);
-    my_sem_post(podID);
-    return val;
+// Appends lit literals from l, then a match of len bytes off back (none if len is 0)
+uint8_t* lz_put_sequence(uint8_t* o, const uint8_t* end, const uint8_t* l, size_t lit, size_t off, size_t len) {
+    size_t m = len ? len - LZ_MIN_MATCH : 0;
+    if(o == end) return NULL;
+    *o++ = (uint8_t) ((lit < 15 ? lit : 15) << 4 | (m < 15 ? m : 15));
+    if(lit >= 15 && (o = lz_put_length(o, end, lit)) == NULL) return NULL;
+    if((size_t) (end - o) < lit) return NULL;
+    memcpy(o, l, lit);
+    o += lit;
+    if(len == 0) return o;
+    if(end - o < 2) return NULL;
+    *o++ = (uint8_t) off;
+    *o++ = (uint8_t) (off >> 8);
+    if(m >= 15) o = lz_put_length(o, end, m);
+    return o;
 }
 
-char** read_pod_all(struct s_pod* p, const char* key) {
-    char** c = calloc(ENTRIES_IN_POD+1, sizeof(char*));
-    int found = 0;
-    for(int i = p->begin; i != p->end; i = inc_pod_index(i)) {
-        if(!strncmp(key, p->entry[i].key, KEY_MAX_LENGTH)) {
-            c[found++] = read_entry(&p->entry[i]);
+// Compresses the n bytes at in into at most cap bytes at out; returns the compressed length, 0 if
+// it would not fit. Stretches without matches are skipped faster the longer they get
+size_t lz_compress(const uint8_t* in, size_t n, uint8_t* out, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t* end = out + cap;
+    uint8_t* o = out;
+    size_t anchor = 0;
+    for(size_t i = 0; n >= LZ_MIN_MATCH && i <= n - LZ_MIN_MATCH; ) {
+        uint32_t h = lz_hash(in + i);
+        size_t   c = table[h];
+        table[h] = (uint32_t) i;
+        if(c >= i || i - c > LZ_MAX_OFFSET || memcmp(in + c, in + i, LZ_MIN_MATCH)) {
+            i += 1 + ((i - anchor) >> 6);
+            continue;
         }
+        size_t len = LZ_MIN_MATCH;
+        while(i + len < n && in[c + len] == in[i + len]) len++;
+        if((o = lz_put_sequence(o, end, in + anchor, i - anchor, i - c, len)) == NULL) return 0;
+        i += len;
+        anchor = i;
     }
-    return c;
+    o = lz_put_sequence(o, end, in + anchor, n - anchor, 0, 0);
+    return o == NULL ? 0 : (size_t) (o - out);
 }
 
-char** read_store_all(struct s_store* s, const char* key) {
-    if(key == NULL) return NULL;
-    int podID = hash(key) % PODS_IN_STORE;
+int lz_get_length(const uint8_t** in, const uint8_t* end, size_t* n) {
+    for(;;) {
+        if(*in == end) return 1;
+        uint8_t b = *(*in)++;
+        *n += b;
+        if(b != 255) return 0;
+    }
+}
+
+// Decodes the n bytes at in into exactly raw bytes at out. Returns 1 if the input is malformed,
+// as a record recycled under an optimistic reader can be, without reading or writing out of bounds
+int lz_decompress(const uint8_t* in, size_t n, char* out, size_t raw) {
+    const uint8_t* end = in + n;
+    size_t o = 0;
+    for(;;) {
+        if(in == end) return 1;
+        unsigned token = *in++;
+        size_t   lit   = token >> 4;
+        if(lit == 15 && lz_get_length(&in, end, &lit)) return 1;
+        if((size_t) (end - in) < lit || raw - o < lit) return 1;
+        memcpy(out + o, in, lit);
+        in += lit;
+        o  += lit;
+        if(in == end) return o != raw;
+        if(end - in < 2) return 1;
+        size_t off = in[0] | (size_t) in[1] << 8;
+        size_t len = token & 15;
+        in += 2;
+        if(len == 15 && lz_get_length(&in, end, &len)) return 1;
+        len += LZ_MIN_MATCH;
+        if(off == 0 || off > o || raw - o < len) return 1;
+        if(off >= len) memcpy(out + o, out + o - off, len);
+        else for(size_t k = 0; k < len; k++) out[o + k] = out[o + k - off];  // Overlapping: repeats the last off bytes
+        o += len;
+    }
+}
+
+//************************************************************************************
+// Arena Functions
+//************************************************************************************
+
+struct s_record* record_at(struct s_store* s, uint32_t off) {
+    return (struct s_record*) ((char*) s + off);
+}
 
-    if(my_sem_wait(podID) == -1) return NULL;
-    char** c = read_pod_all(&s->pod[podID], key);
-    my_sem_post(podID);
+int block_class(size_t bytes) {
+    int c = 0;
+    while(c < NUM_CLASSES && (size_t) (MIN_BLOCK << c) < bytes) c++;
     return c;
 }
 
-//************************************************************************
-// Debug functions
-//************************************************************************
-void printf_entry(const struct s_entry* e) {
-    printf("%s\t%s\n", e->key, e->val);
+int size_class(size_t len) {
+    return block_class(sizeof(struct s_record) + len);
 }
 
-void printf_pod(const struct s_pod* p) {
-    for(int i = 0; i < PODS_IN_STORE; i++) {
-        printf_entry(&p->entry[i]);
-    }
-    printf("\n");
+// Room for the block header and the padding that aligns the pod (see pod_in_block)
+int pod_class(void) {
+    return block_class(CACHE_LINE + sizeof(struct s_pod));
 }
 
-//***********************************************************************
-// Key-Value Store API
-//***********************************************************************
+// Extends the segment so at least need bytes past top are backed; the arena lock is held
+int arena_grow(struct s_store* s, uint32_t need) {
+    struct s_arena* a = &s->arena;
+    size_t limit = align_segment(((size_t) a->top + need + GROW_BYTES - 1) & ~(size_t) (GROW_BYTES - 1));
+    if(limit > MAX_STORE_BYTES || ftruncate(store_fd, limit) || populate_segment(s, a->limit, limit)) return 1;
+    a->limit = (uint32_t) limit;
+    return 0;
+}
 
-sem_t* sem_clr;
-int kv_store_create(const char* name) {
-    init_sem();
+void push_free(struct s_store* s, uint32_t off) {
+    struct s_arena*  a = &s->arena;
+    struct s_record* r = record_at(s, off);
+    memcpy(r->data, &a->free_list[r->cls], sizeof(uint32_t));
+    __atomic_store_n(&a->free_list[r->cls], off, __ATOMIC_RELEASE);
+}
 
-    int fd = shm_open(name, O_CREAT|O_RDWR, S_IRWXU);
-    if(fd < 0) {
-        printf("Failed to create shared memory object\n");
-        return 1;
-    }
+// Retired records are logged in a block of their own rather than linked through their data,
+// which pinned readers may still be using. The log is a ring of a power-of-two number of pairs,
+// half the block, so the free-running indexes wrap with it
+uint32_t retire_capacity(struct s_store* s) {
+    if(s->arena.retired == NO_BLOCK) return 0;
+    return (MIN_BLOCK << record_at(s, s->arena.retired)->cls) / (4 * sizeof(uint32_t));
+}
 
-    char* addr = mmap(NULL, sizeof(struct s_store), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-    ftruncate(fd, sizeof(struct s_store));
-    close(fd);
-    mm_store = (struct s_store*) addr;
+// Pair i of the log in block off, of capacity cap
+uint32_t* log_slot(struct s_store* s, uint32_t off, uint32_t cap, uint32_t i) {
+    return (uint32_t*) record_at(s, off)->data + 2 * (i & (cap - 1));
+}
+
+uint32_t* retire_slot(struct s_store* s, uint32_t i) {
+    return log_slot(s, s->arena.retired, retire_capacity(s), i);
+}
+
+// Moves retired records no pinned reader can still see to their free lists; the arena lock is held.
+// Epochs grow along the ring, so those are its oldest pairs. Each leaves the ring before its record
+// is freed: a holder dying in between leaks the record rather than letting the next one free it again
+void reclaim(struct s_store* s) {
+    struct s_arena* a = &s->arena;
+    unsigned min = a->retire_begin != a->retire_end ? min_pinned(s) : 0;
+    while(a->retire_begin != a->retire_end && epoch_before(retire_slot(s, a->retire_begin)[1], min)) {
+        uint32_t off = retire_slot(s, a->retire_begin)[0];
+        __atomic_store_n(&a->retire_begin, a->retire_begin + 1, __ATOMIC_RELEASE);
+        push_free(s, off);
+    }
+}
 
-    sem_clr = sem_open("sem_unique", O_CREAT | O_EXCL, S_IRWXU, 1);
-    if(sem_clr != SEM_FAILED) {
-        init_store(mm_store);
+// Returns the offset of a block of class c, or NO_BLOCK if the arena is exhausted; the arena lock is held
+uint32_t take_block(struct s_store* s, int c) {
+    struct s_arena* a = &s->arena;
+    uint32_t size = MIN_BLOCK << c;
+    if(a->free_list[c] == NO_BLOCK) reclaim(s);
+    uint32_t off = a->free_list[c];
+    if(off != NO_BLOCK) {
+        uint32_t next;
+        memcpy(&next, record_at(s, off)->data, sizeof(uint32_t));
+        __atomic_store_n(&a->free_list[c], next, __ATOMIC_RELEASE);
     }
+    else if(a->limit - a->top >= size || !arena_grow(s, size)) {
+        off = a->top;
+        __atomic_store_n(&a->top, a->top + size, __ATOMIC_RELEASE);
+    }
+    if(off != NO_BLOCK) record_at(s, off)->owner = 0;    // Whoever held the block before no longer owns it
+    return off;
+}
 
-    db_name = calloc(strlen(name)+1, sizeof(char));
-    strcpy(db_name, name);
+uint32_t arena_alloc(struct s_store* s, int c) {
+    if(lock_arena(&s->arena)) return NO_BLOCK;
+    uint32_t off = take_block(s, c);
+    pthread_mutex_unlock(&s->arena.lock);
+    return off;
+}
+
+// Frees a record no reader has seen yet
+void arena_free(struct s_store* s, uint32_t off) {
+    if(lock_arena(&s->arena)) return;
+    push_free(s, off);
+    pthread_mutex_unlock(&s->arena.lock);
+}
+
+// Moves the retire log to a block twice its size; returns 1 if the arena is exhausted. Pairs keep
+// their indexes, so switching to the new log is one store, and the old one is freed only after it
+int grow_retire_log(struct s_store* s) {
+    struct s_arena* a = &s->arena;
+    int c = a->retired == NO_BLOCK ? size_class(128 * sizeof(uint32_t)) : (int) record_at(s, a->retired)->cls + 1;
+    if(c >= NUM_CLASSES) return 1;
+    uint32_t off = take_block(s, c);
+    if(off == NO_BLOCK) return 1;
+    record_at(s, off)->len = 0;
+    record_at(s, off)->cls = c;
+    uint32_t old = a->retired;
+    uint32_t cap = (MIN_BLOCK << c) / (4 * sizeof(uint32_t));
+    for(uint32_t i = a->retire_begin; i != a->retire_end; i++) {
+        memcpy(log_slot(s, off, cap, i), retire_slot(s, i), 2 * sizeof(uint32_t));
+    }
+    __atomic_store_n(&a->retired, off, __ATOMIC_RELEASE);
+    if(old != NO_BLOCK) push_free(s, old);
     return 0;
 }
 
-int kv_store_write(const char* key, const char* value) {
-    return write_store(mm_store, key, value); //note: returns 0 on success, 1 on failure
+// Frees a record once readers that may still hold it have unpinned; it must already be unlinked.
+// If the log cannot grow, the record is leaked until the next recovery pass
+void arena_retire(struct s_store* s, uint32_t off) {
+    struct s_arena* a = &s->arena;
+    if(lock_arena(a)) return;
+    if(a->retire_end - a->retire_begin == retire_capacity(s)) reclaim(s);
+    if(a->retire_end - a->retire_begin < retire_capacity(s) || !grow_retire_log(s)) {
+        uint32_t* pair = retire_slot(s, a->retire_end);
+        pair[0] = off;
+        pair[1] = atomic_fetch_add(&s->epoch, 1);
+        __atomic_store_n(&a->retire_end, a->retire_end + 1, __ATOMIC_RELEASE);  // Published once complete
+    }
+    pthread_mutex_unlock(&a->lock);
 }
 
-char* kv_store_read(const char* key) {
-    return read_store(mm_store, key);
+// Compresses the len bytes of val into a buffer returned in *buf, if that saves at least a size
+// class. Returns the packed length (the value's length, then the compressed bytes), or 0
+size_t pack_value(const char* val, size_t len, char** buf) {
+    int c = size_class(len);
+    if(len < COMPRESS_MIN || c == 0) return 0;
+    size_t   cap = (MIN_BLOCK << (c-1)) - sizeof(struct s_record);
+    uint32_t raw = (uint32_t) len;
+    if(cap <= sizeof(raw) || (*buf = malloc(cap)) == NULL) return 0;
+    memcpy(*buf, &raw, sizeof(raw));
+    size_t n = lz_compress((const uint8_t*) val, len, (uint8_t*) *buf + sizeof(raw), cap - sizeof(raw));
+    if(n == 0) {
+        free(*buf);
+        *buf = NULL;
+        return 0;
+    }
+    return sizeof(raw) + n;
 }
 
-char** kv_store_read_all(const char* key) {
-    char** c = read_store_all(mm_store, key);
-    if(c[0] == NULL) { //To satisfy automatic test
+// Copies val into a new record, compressed if the store asks for it and that pays; returns
+// NO_BLOCK if it is too long or the arena is full
+uint32_t new_record(struct s_store* s, const char* val) {
+    size_t len = strlen(val);
+    if(len > VALUE_MAX_LENGTH) return NO_BLOCK;
+    char*  buf  = NULL;
+    size_t plen = s->compress ? pack_value(val, len, &buf) : 0;
+    if(plen) {
+        val = buf;
+        len = plen;
+    }
+    int c = size_class(len);
+    uint32_t off = arena_alloc(s, c);
+    if(off != NO_BLOCK) {
+        struct s_record* r = record_at(s, off);
+        r->len    = (uint32_t) len;
+        r->cls    = (uint16_t) c;
+        r->packed = plen != 0;
+        memcpy(r->data, val, len);
+    }
+    free(buf);
+    return off;
+}
+
+// Decompresses the len bytes of packed record r into a new NUL-terminated buffer, its length in
+// *raw; NULL if the record is malformed
+char* unpack_record(const struct s_record* r, uint32_t len, size_t* raw) {
+    uint32_t n;
+    if(len < sizeof(n)) return NULL;
+    memcpy(&n, r->data, sizeof(n));
+    if(n > VALUE_MAX_LENGTH) return NULL;
+    char* c = malloc(n+1);
+    if(c == NULL) return NULL;
+    if(lz_decompress((const uint8_t*) r->data + sizeof(n), len - sizeof(n), c, n)) {
         free(c);
-        c = NULL;
+        return NULL;
     }
+    c[n] = 0;
+    *raw = n;
     return c;
 }
 
-int kv_delete_db() {
-    sem_unlink("sem_unique");
-    sem_close(sem_clr);
-    close_sem();
-    munmap(mm_store, sizeof(struct s_store));
+// Value of record off for the view API: in place, or decompressed into *buf, which the caller
+// frees. NULL if it cannot be decompressed
+const char* record_value(struct s_store* s, uint32_t off, size_t* len, char** buf) {
+    struct s_record* r = record_at(s, off);
+    *buf = NULL;
+    if(!r->packed) {
+        *len = r->len;
+        return r->data;
+    }
+    return *buf = unpack_record(r, r->len, len);
+}
+
+int same_record(struct s_store* s, uint32_t a, uint32_t b) {
+    struct s_record* ra = record_at(s, a);
+    struct s_record* rb = record_at(s, b);
+    return ra->len == rb->len && !memcmp(ra->data, rb->data, ra->len);
+}
+
+//************************************************************************************
+// Snapshot Functions
+//************************************************************************************
+
+uint32_t* snap_table(struct s_store* s) {
+    return (uint32_t*) record_at(s, s->snap_table)->data;
+}
+
+// Called by writers holding p's lock before they change it. While a snapshot runs, the first
+// change to a pod it has not copied yet saves a copy for it. If the arena is exhausted the
+// snapshot is marked torn rather than holding up the write
+void preserve_pod(struct s_store* s, struct s_pod* p) {
+    unsigned g = atomic_load(&s->snap);
+    if(g == 0 || p->snap == g || p->id >= s->snap_pods) return;
+    int c = pod_class();
+    uint32_t off = arena_alloc(s, c);
+    if(off == NO_BLOCK) s->snap_torn = 1;
+    else {
+        record_at(s, off)->len = 0;
+        record_at(s, off)->cls = c;
+        memcpy(pod_in_block(s, off), p, sizeof(struct s_pod));
+        snap_table(s)[p->id] = off;
+    }
+    p->snap = g;
+}
+
+// Stops the running snapshot and frees its copies. Locking each pod waits out writers that saw
+// the snapshot running and may still be saving a copy. Entries are cleared before being freed,
+// so a taker dying here leaks copies at worst
+void end_snapshot(struct s_store* s) {
+    atomic_store(&s->snap, 0);
+    if(s->snap_table != NO_BLOCK) {
+        uint32_t* t = snap_table(s);
+        for(uint32_t id = 0; id < s->snap_pods; id++) {
+            if(lock_pod(s, pod_at(s, id)) == 0) unlock_pod(pod_at(s, id));
+            uint32_t off = t[id];
+            t[id] = NO_BLOCK;
+            if(off != NO_BLOCK) arena_free(s, off);
+        }
+        uint32_t off = s->snap_table;
+        s->snap_table = NO_BLOCK;
+        arena_free(s, off);
+    }
+}
+
+// Starts a snapshot; returns its generation, or 0 if another one is running or the arena is
+// exhausted. A snapshot left running by a dead thread is ended first
+unsigned begin_snapshot(struct s_store* s) {
+    int tid   = (int) syscall(SYS_gettid);
+    int owner = 0;
+    if(!atomic_compare_exchange_strong(&s->snap_owner, &owner, tid)) {
+        if(!(kill(owner, 0) == -1 && errno == ESRCH) || !atomic_compare_exchange_strong(&s->snap_owner, &owner, tid)) {
+            printf("Snapshot already running\n");
+            return 0;
+        }
+        end_snapshot(s);
+    }
+
+    // Under the directory lock no split is half done, so the pods counted hold every key
+    if(lock_dir(s)) {
+        atomic_store(&s->snap_owner, 0);
+        return 0;
+    }
+    uint32_t npods = atomic_load(&s->npods);
+    uint32_t off   = arena_alloc(s, size_class(npods * sizeof(uint32_t)));
+    unsigned g     = 0;
+    if(off != NO_BLOCK) {
+        record_at(s, off)->len = 0;
+        record_at(s, off)->cls = size_class(npods * sizeof(uint32_t));
+        s->snap_table = off;
+        for(uint32_t id = 0; id < npods; id++) snap_table(s)[id] = NO_BLOCK;
+        s->snap_pods = npods;
+        s->snap_torn = 0;
+        if(++s->snap_gen == 0) s->snap_gen = 1;           // 0 means no snapshot
+        g = s->snap_gen;
+        atomic_store(&s->snap, g);
+    }
+    pthread_mutex_unlock(&s->dir_lock);
+    if(g == 0) atomic_store(&s->snap_owner, 0);
+    return g;
+}
+
+// Returns pod id as it was when snapshot g started: the copy a writer saved, or else a copy
+// made into img under the pod's lock, after which writers no longer save one
+struct s_pod* snapshot_pod(struct s_store* s, uint32_t id, unsigned g, struct s_pod* img) {
+    struct s_pod* p = pod_at(s, id);
+    if(lock_pod(s, p)) {
+        s->snap_torn = 1;
+        return NULL;
+    }
+    uint32_t off = snap_table(s)[id];
+    if(off == NO_BLOCK) memcpy(img, p, sizeof(struct s_pod));
+    p->snap = g;
+    unlock_pod(p);
+    return off == NO_BLOCK ? img : pod_in_block(s, off);
+}
+
+// Calls cb on every pair live when the snapshot starts, pod by pod and each key's values
+// oldest first, until cb returns non-zero. The caller has pinned the epoch, so records the
+// copies refer to stay valid. Returns 1 if the snapshot could not start or is not consistent
+int snapshot_store(struct s_store* s, kv_scan_cb cb, void* arg) {
+    struct s_pod* img = aligned_alloc(CACHE_LINE, sizeof(struct s_pod));
+    if(img == NULL) return 1;
+    unsigned g = begin_snapshot(s);
+    if(g == 0) {
+        free(img);
+        return 1;
+    }
+    uint32_t now  = now_sec();
+    int      stop = 0;
+    for(uint32_t id = 0; id < s->snap_pods && !stop; id++) {
+        struct s_pod* p = snapshot_pod(s, id, g, img);
+        if(p == NULL) continue;
+        for(int e = p->begin; e != p->end && !stop; e = inc_pod_index(e)) {
+            const struct s_entry* en = &p->entry[e];
+            if(expired(en, now)) continue;
+            char   key[KEY_MAX_LENGTH+1];
+            char*  buf;
+            size_t len;
+            const char* v = record_value(s, en->val, &len, &buf);
+            if(v == NULL) continue;
+            memcpy(key, p->key[e].str, KEY_MAX_LENGTH);
+            key[KEY_MAX_LENGTH] = 0;
+            stop = cb(key, v, len, arg);
+            free(buf);
+        }
+    }
+    free(img);
+    int torn = s->snap_torn;
+    end_snapshot(s);
+    atomic_store(&s->snap_owner, 0);
+    return torn;
+}
+
+//************************************************************************************
+// Directory Functions
+//************************************************************************************
+
+// Allocates and initializes pod number id; returns NULL if the arena is exhausted
+// The pod is only reachable once the caller publishes off in s->pod[id] and the directory
+struct s_pod* new_pod(struct s_store* s, uint32_t id, uint32_t depth, uint32_t prefix, uint32_t* off) {
+    int c = pod_class();
+    *off = arena_alloc(s, c);
+    if(*off == NO_BLOCK) return NULL;
+    record_at(s, *off)->len = 0;
+    record_at(s, *off)->cls = c;
+    struct s_pod* p = pod_in_block(s, *off);
+    init_pod(p);
+    if(init_lock(&p->lock)) return NULL;
+    p->id     = id;
+    p->depth  = depth;
+    p->prefix = prefix;
+    return p;
+}
+
+// flags are the KV_ORDERED and KV_STATS flags of the open creating the store. The ordered index,
+// if any, is built once the store's locks are usable (see start_store)
+int init_store(struct s_store* s, int policy, int flags) {
+    if(init_arena(&s->arena) || init_lock(&s->dir_lock) || init_lock(&s->order_lock) || init_lock(&s->hot_lock)) {
+        printf("Creating store locks failed\n");
+        return 1;
+    }
+    for(uint32_t i = 0; i < (1u << INITIAL_DEPTH); i++) {
+        if(new_pod(s, i, INITIAL_DEPTH, i, &s->pod[i]) == NULL) {
+            printf("Creating pod failed\n");
+            return 1;
+        }
+        atomic_init(&s->dir[i], i);
+    }
+    atomic_init(&s->npods, 1u << INITIAL_DEPTH);
+    atomic_init(&s->depth, INITIAL_DEPTH);
+    atomic_init(&s->epoch, 1);                            // Epoch 0 marks an idle reader slot
+    for(int i = 0; i < MAX_READERS; i++) {
+        atomic_init(&s->reader[i].tid, 0);
+        atomic_init(&s->reader[i].epoch, 0);
+    }
+    atomic_init(&s->clean, 0);
+    atomic_init(&s->snap, 0);
+    atomic_init(&s->snap_owner, 0);
+    s->snap_gen   = 0;
+    s->snap_table = NO_BLOCK;
+    s->split_pod  = MAX_PODS;
+    memset(s->hot, 0, sizeof(s->hot));
+    s->policy  = policy;
+    s->ordered = (flags & KV_ORDERED) != 0;
+    s->stats   = (flags & KV_STATS) != 0;
+    s->compress = (flags & KV_COMPRESS) != 0;
+    s->order   = NO_BLOCK;
+    s->version = STORE_VERSION;
+    memcpy(s->geometry, store_geometry, sizeof(store_geometry));
+    s->magic   = STORE_MAGIC;                             // Last: marks the store as initialized
+    return 0;
+}
+
+// Splits the locked pod p on its next hash bit, moving half its keys to a new pod.
+// Called inside write_begin/write_end of p; returns 1 if the store cannot grow any further, or
+// if the bit would move none or all of p's entries, as when one key's values fill the pod
+int split_pod(struct s_store* s, struct s_pod* p) {
+    if(p->depth == MAX_DEPTH) return 1;
+    uint32_t bit   = 1u << p->depth;
+    int      moved = 0;
+    for(int e = p->begin; e != p->end; e = inc_pod_index(e)) moved += (p->entry[e].hash & bit) != 0;
+    if(moved == 0 || moved == ring_offset(p, p->end) || lock_dir(s)) return 1;
+    preserve_pod(s, p);                                   // A snapshot started since the write began skips the new pod
+
+    unsigned depth = atomic_load(&s->depth);
+    uint32_t id    = atomic_load(&s->npods);
+    uint32_t off;
+    struct s_pod* q = new_pod(s, id, p->depth+1, p->prefix | bit, &off);
+    if(q == NULL) {
+        pthread_mutex_unlock(&s->dir_lock);
+        return 1;
+    }
+    q->stamp  = p->stamp;                                 // Moved entries keep their stamps
+    q->expiry = p->expiry;
+    s->split_id = id;
+    __atomic_store_n(&s->split_pod, p->id, __ATOMIC_RELEASE);
+
+    // Steps are ordered so a crash at any point leaves every entry in a pod the directory, as
+    // rebuilt by recovery, maps it to: copy to q, publish q, then drop the copies from p
+    for(int e = p->begin; e != p->end; e = inc_pod_index(e)) {
+        if(p->entry[e].hash & bit) append_entry(q, p, e);
+    }
+    s->pod[id] = off;
+    atomic_store(&s->npods, id+1);
+    if(p->depth == depth) double_dir(s, depth++);
+    for(unsigned i = q->prefix; i < (1u << depth); i += bit << 1) {
+        atomic_store_explicit(&s->dir[i], id, memory_order_release);
+    }
+    p->depth++;
+
+    // Compact p in place, keeping ring order so each key's chain keeps its order
+    int w = p->begin;
+    for(int e = p->begin; e != p->end; e = inc_pod_index(e)) {
+        if(p->entry[e].hash & bit) continue;
+        if(w != e) copy_entry(p, w, p, e);
+        w = inc_pod_index(w);
+    }
+    p->end = w;
+    rebuild_pod(p);
+    __atomic_store_n(&s->split_pod, MAX_PODS, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&s->dir_lock);
+    return 0;
+}
+
+//************************************************************************************
+// Order Functions
+//************************************************************************************
+
+struct s_node* node_at(struct s_store* s, uint32_t off) {
+    return (struct s_node*) record_at(s, off)->data;
+}
+
+// Byte order, which zero padding makes the order of the NUL-terminated keys
+int cmp_key(const union u_key* a, const union u_key* b) {
+    return memcmp(a->str, b->str, sizeof(a->str));
+}
+
+uint32_t next_node(struct s_store* s, uint32_t off, int level) {
+    return atomic_load_explicit(&node_at(s, off)->next[level], memory_order_acquire);
+}
+
+// Fills pred, if not NULL, with the last node before key at each level, and returns the node
+// holding key or NO_BLOCK. Lock-free readers must have pinned the epoch
+uint32_t order_find(struct s_store* s, const union u_key* key, uint32_t* pred) {
+    uint32_t x = s->order, n;
+    for(int l = ORDER_LEVELS-1; l >= 0; l--) {
+        while((n = next_node(s, x, l)) != NO_BLOCK && cmp_key(&node_at(s, n)->key, key) < 0) x = n;
+        if(pred != NULL) pred[l] = x;
+    }
+    n = next_node(s, x, 0);
+    return n != NO_BLOCK && same_key(&node_at(s, n)->key, key) ? n : NO_BLOCK;
+}
+
+// Allocates a node of the given height; returns NO_BLOCK if the arena is exhausted
+uint32_t new_node(struct s_store* s, const union u_key* key, int height) {
+    int c = block_class(sizeof(struct s_record) + sizeof(struct s_node) + height * sizeof(atomic_uint));
+    uint32_t off = arena_alloc(s, c);
+    if(off == NO_BLOCK) return NO_BLOCK;
+    record_at(s, off)->len = 0;
+    record_at(s, off)->cls = c;
+    struct s_node* n = node_at(s, off);
+    n->key    = *key;
+    n->height = height;
+    for(int l = 0; l < height; l++) atomic_init(&n->next[l], NO_BLOCK);
+    return off;
+}
+
+// Adds key to the index unless it is there already. The node is complete before it is linked,
+// bottom-up, so readers see it at no level or with everything below that level in place.
+// If the arena is exhausted the key is left out, and scans miss it
+void order_insert(struct s_store* s, const union u_key* key) {
+    uint32_t pred[ORDER_LEVELS];
+    if(lock_order(s)) return;
+    if(order_find(s, key, pred) == NO_BLOCK) {
+        int height = 1;
+        while(height < ORDER_LEVELS && (fast_rand() & 3) == 0) height++;
+        uint32_t off = new_node(s, key, height);
+        if(off != NO_BLOCK) {
+            struct s_node* n = node_at(s, off);
+            for(int l = 0; l < height; l++) atomic_init(&n->next[l], next_node(s, pred[l], l));
+            for(int l = 0; l < height; l++) {
+                atomic_store_explicit(&node_at(s, pred[l])->next[l], off, memory_order_release);
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->order_lock);
+}
+
+// Removes key from the index, top-down; the node keeps its links for readers still on it and is
+// retired, not freed
+void order_remove(struct s_store* s, const union u_key* key) {
+    uint32_t pred[ORDER_LEVELS];
+    if(lock_order(s)) return;
+    uint32_t off = order_find(s, key, pred);
+    if(off != NO_BLOCK) {
+        struct s_node* n = node_at(s, off);
+        for(int l = n->height-1; l >= 0; l--) {
+            if(next_node(s, pred[l], l) == off) atomic_store_explicit(&node_at(s, pred[l])->next[l], next_node(s, off, l), memory_order_release);
+        }
+        arena_retire(s, off);
+    }
+    pthread_mutex_unlock(&s->order_lock);
+}
+
+// Builds the index from the keys in the pods; nobody else is attached
+int build_order(struct s_store* s) {
+    s->order = new_node(s, &(union u_key) { .w = { 0 } }, ORDER_LEVELS);
+    if(s->order == NO_BLOCK) {
+        printf("Creating ordered index failed\n");
+        return 1;
+    }
+    for(uint32_t id = 0; id < atomic_load(&s->npods); id++) {
+        struct s_pod* p = pod_at(s, id);
+        for(int i = 0; i < INDEX_SLOTS; i++) {
+            if(p->tag[i] != 0) order_insert(s, &p->key[p->index[i].head]);
+        }
+    }
+    return 0;
+}
+
+// Returns the record of key's newest live value, or NO_BLOCK; the caller has pinned the epoch
+uint32_t newest_value(struct s_store* s, const union u_key* key, uint32_t now) {
+    unsigned h = hash(key);
+    uint32_t rec;
+    for(;;) {
+        struct s_pod* p = find_pod(s, h);
+        unsigned seq = read_begin(s, p);
+        rec = NO_BLOCK;
+        int slot = index_find(p, key, h);
+        if(slot != NO_ENTRY) {
+            int i = p->index[slot].head;
+            for(int n = 0; n < ENTRIES_IN_POD && i != NO_ENTRY; n++, i = p->entry[i].next) {
+                if(!expired(&p->entry[i], now)) rec = p->entry[i].val;
+            }
+        }
+        if(!read_retry(p, seq) && find_pod(s, h) == p) break;
+    }
+    return rec;
+}
+
+// Calls cb on each key starting with prefix, in byte order, with its newest live value in place,
+// until cb returns non-zero. Keys with no live value are skipped. The epoch is pinned
+void scan_store(struct s_store* s, const char* prefix, kv_scan_cb cb, void* arg) {
+    union u_key k;
+    pack_key(&k, prefix);
+    size_t   len = strnlen(prefix, KEY_MAX_LENGTH);
+    uint32_t now = now_sec();
+    uint32_t pred[ORDER_LEVELS];
+    order_find(s, &k, pred);
+    for(uint32_t x = next_node(s, pred[0], 0); x != NO_BLOCK; x = next_node(s, x, 0)) {
+        struct s_node* n = node_at(s, x);
+        if(memcmp(n->key.str, prefix, len)) break;
+        uint32_t rec = newest_value(s, &n->key, now);
+        if(rec == NO_BLOCK) continue;
+        char   key[KEY_MAX_LENGTH+1];
+        char*  buf;
+        size_t len;
+        const char* v = record_value(s, rec, &len, &buf);
+        if(v == NULL) continue;
+        memcpy(key, n->key.str, KEY_MAX_LENGTH);
+        key[KEY_MAX_LENGTH] = 0;
+        int stop = cb(key, v, len, arg);
+        free(buf);
+        if(stop) break;
+    }
+}
+
+//************************************************************************************
+// Write Functions
+//************************************************************************************
+
+void write_entry(struct s_pod* p, int e, const union u_key* key, uint32_t val, unsigned h, uint32_t stamp, uint32_t expires) {
+    struct s_entry* s = &p->entry[e];
+    p->key[e]  = *key;
+    s->val     = val;
+    s->hash    = h;
+    s->stamp   = stamp;
+    s->expires = expires;
+    s->next    = NO_ENTRY;
+    s->hits    = 0;                                       // Unread: one-off writes are evicted first
+}
+
+// Drops the expired entries of the locked pod and those marked in victim (which may be NULL),
+// keeping ring order, and retires their records. Keys left with no entry leave the ordered
+// index. Called inside write_begin/write_end of p; returns how many entries were dropped
+int drop_entries(struct s_store* s, struct s_pod* p, uint32_t now, const uint8_t* victim) {
+    uint32_t    dropped[ENTRIES_IN_POD];
+    union u_key gone[ENTRIES_IN_POD];
+    int n = 0;
+    int w = p->begin;
+    p->expiry = 0;
+    for(int e = p->begin; e != p->end; e = inc_pod_index(e)) {
+        if(expired(&p->entry[e], now) || (victim != NULL && victim[e])) {
+            if(s->order != NO_BLOCK) gone[n] = p->key[e];
+            dropped[n++] = p->entry[e].val;
+            continue;
+        }
+        note_expiry(p, p->entry[e].expires);
+        if(w != e) copy_entry(p, w, p, e);
+        w = inc_pod_index(w);
+    }
+    if(n == 0) return 0;
+    p->end = w;
+    rebuild_pod(p);
+    for(int i = 0; i < n; i++) arena_retire(s, dropped[i]);
+    for(int i = 0; i < n && s->order != NO_BLOCK; i++) {
+        if(index_find(p, &gone[i], hash(&gone[i])) == NO_ENTRY) order_remove(s, &gone[i]);
+    }
+    return n;
+}
+
+int compact_pod(struct s_store* s, struct s_pod* p, uint32_t now) {
+    if(p->expiry == 0 || p->expiry > now) return 0;
+    int n = drop_entries(s, p, now, NULL);
+    count_op(s, &p->stats.expired, n);
+    return n;
+}
+
+// Compacts every pod holding expired entries; run by the sweeper thread
+void sweep_store(struct s_store* s) {
+    uint32_t now = now_sec();
+    for(uint32_t id = 0; id < atomic_load(&s->npods); id++) {
+        struct s_pod* p = pod_at(s, id);
+        if(p->expiry == 0 || p->expiry > now) continue;  // Unlocked peek, rechecked by compact_pod
+        if(lock_pod(s, p)) continue;
+        preserve_pod(s, p);
+        write_begin(p);
+        compact_pod(s, p, now);
+        write_end(p);
+        unlock_pod(p);
+    }
+}
+
+// Marks up to EVICT_BATCH victims of the full pod p in victim, CLOCK style: the hand sweeps the
+// ring from where it last stopped, giving entries read since it last passed a second chance
+int clock_victims(struct s_pod* p, uint8_t* victim) {
+    int size = ring_offset(p, p->end);
+    int n = 0, o = p->hand < (unsigned) size ? (int) p->hand : 0;
+    for(int k = 0; k < 2 * size && n < EVICT_BATCH; k++, o = o+1 == size ? 0 : o+1) {
+        struct s_entry* e = &p->entry[wrap_pod_index(p->begin + o)];
+        if(entry_hits(e)) __atomic_store_n(&e->hits, 0, __ATOMIC_RELAXED);
+        else {
+            victim[wrap_pod_index(p->begin + o)] = 1;
+            n++;
+        }
+    }
+    // Dropping the victims shifts the ring: keep the hand on the entry it points at
+    int behind = 0;
+    for(int k = 0; k < o; k++) behind += victim[wrap_pod_index(p->begin + k)];
+    p->hand = o - behind;
+    return n;
+}
+
+// Marks up to EVICT_BATCH victims of the full pod p in victim, each the least read of
+// LFU_SAMPLES random entries (the oldest on a tie). Counts are halved every LFU_DECAY evictions
+// so entries that were hot once do not stay forever, but slowly enough that keys read once per
+// few turnovers of the pod outlast a stream of keys never read
+int lfu_victims(struct s_pod* p, uint8_t* victim) {
+    int size = ring_offset(p, p->end);
+    int n = 0;
+    for(int k = 0; k < EVICT_BATCH; k++) {
+        int best = NO_ENTRY;
+        for(int j = 0; j < LFU_SAMPLES; j++) {
+            int o = (int) (((uint64_t) fast_rand() * size) >> 32);  // Uniform in [0, size) without a division
+            int e = wrap_pod_index(p->begin + o);
+            if(victim[e]) continue;
+            if(best == NO_ENTRY || entry_hits(&p->entry[e]) < entry_hits(&p->entry[best]) ||
+               (entry_hits(&p->entry[e]) == entry_hits(&p->entry[best]) && o < ring_offset(p, best))) best = e;
+        }
+        if(best == NO_ENTRY) continue;
+        victim[best] = 1;
+        n++;
+    }
+    p->aged += n;
+    if(p->aged >= LFU_DECAY) {
+        for(int e = p->begin; e != p->end; e = inc_pod_index(e)) {
+            __atomic_store_n(&p->entry[e].hits, entry_hits(&p->entry[e]) / 2, __ATOMIC_RELAXED);
+        }
+        p->aged = 0;
+    }
+    return n;
+}
+
+// Makes room in the full, locked pod p once it cannot split, following the store's eviction
+// policy. CLOCK and LFU drop a batch of victims in one compaction and retire their records;
+// FIFO unlinks the oldest entry in O(1) and leaves its record in *evicted for the caller.
+// Called inside write_begin/write_end of p
+void evict_pod(struct s_store* s, struct s_pod* p, uint32_t now, uint32_t* evicted) {
+    if(s->policy == KV_EVICT_CLOCK || s->policy == KV_EVICT_LFU) {
+        uint8_t victim[ENTRIES_IN_POD] = { 0 };
+        int n = s->policy == KV_EVICT_CLOCK ? clock_victims(p, victim) : lfu_victims(p, victim);
+        if(n && (n = drop_entries(s, p, now, victim))) {
+            count_op(s, &p->stats.evictions, n);
+            return;
+        }
+    }
+    int e = p->begin;                                     // Kept intact until the next append
+    count_op(s, &p->stats.evictions, 1);
+    *evicted = evict_oldest(p);
+    if(s->order != NO_BLOCK && index_find(p, &p->key[e], p->entry[e].hash) == NO_ENTRY) order_remove(s, &p->key[e]);
+}
+
+#define POD_SPLIT 2
+
+// Makes val the only value of the key in slot: its newest entry takes val in place, with a new
+// stamp so cursors read it, and older entries become tombstones. *evicted receives the record
+// val replaces
+void replace_entry(struct s_pod* p, int slot, uint32_t val, uint32_t expires, uint32_t* evicted) {
+    int t = p->index[slot].tail;
+    write_begin(p);
+    for(int i = p->index[slot].head; i != t; i = p->entry[i].next) p->entry[i].expires = TOMBSTONE;
+    if(p->index[slot].head != t) note_expiry(p, TOMBSTONE);
+    p->index[slot].head = t;
+    struct s_entry* e = &p->entry[t];
+    *evicted   = e->val;
+    e->val     = val;
+    e->stamp   = ++p->stamp;
+    e->expires = expires;
+    note_expiry(p, expires);
+    write_end(p);
+}
+
+// Turns every entry of key into a tombstone and unlinks the key from the locked pod.
+// Returns 0 if it had a live value, 1 otherwise
+int delete_pod(struct s_pod* p, const union u_key* key, unsigned h, uint32_t now) {
+    int slot = index_find(p, key, h);
+    if(slot == NO_ENTRY) return 1;
+    int found = 0;
+    write_begin(p);
+    for(int i = p->index[slot].head; i != NO_ENTRY; i = p->entry[i].next) {
+        found |= !expired(&p->entry[i], now);
+        p->entry[i].expires = TOMBSTONE;
+    }
+    note_expiry(p, TOMBSTONE);
+    index_remove(p, slot);
+    write_end(p);
+    return !found;
+}
+
+// Links the already written record val into the pod; *evicted receives a record to free, if any.
+// Returns POD_SPLIT if the pod was full and got split, in which case the key may have moved.
+// With replace set, val becomes the key's only value (see replace_entry). Otherwise a live
+// duplicate pair is not added again, but takes the new expiry
+int write_pod(struct s_store* s, struct s_pod* p, const union u_key* key, uint32_t val, unsigned h, uint32_t expires, int replace, uint32_t* evicted) {
+    uint32_t now = now_sec();
+    preserve_pod(s, p);
+    int slot = index_find(p, key, h);
+    if(slot != NO_ENTRY && replace) {
+        record_at(s, val)->owner = owner_tag(h, p->stamp + 1);  // The stamp replace_entry gives it
+        replace_entry(p, slot, val, expires, evicted);
+        count_op(s, &p->stats.writes, 1);
+        return 0;
+    }
+    if(slot != NO_ENTRY) {
+        for(int i = p->index[slot].head; i != NO_ENTRY; i = p->entry[i].next) {
+            if(expired(&p->entry[i], now) || !same_record(s, val, p->entry[i].val)) continue;
+            p->entry[i].expires = expires;                // Duplicate pair
+            note_expiry(p, expires);
+            count_op(s, &p->stats.writes, 1);
+            return 1;
+        }
+    }
+
+    // Only compactions, splits and evictions move or drop entries readers may be using; appends
+    // go unbracketed. Expired entries make room first, so live ones are not split off or evicted
+    int full = pod_full(p);
+    if(full) {
+        write_begin(p);
+        if(!compact_pod(s, p, now)) {
+            if(!split_pod(s, p)) {
+                write_end(p);
+                return POD_SPLIT;
+            }
+            evict_pod(s, p, now, evicted);                // Store at full size, or nothing to split: evict by policy
+        }
+    }
+    // Making room may have dropped the key's last entries, and its ordered index node with them.
+    // Added before the key is linked: a crash may leave it stale, not missing
+    if(s->order != NO_BLOCK && (slot == NO_ENTRY || full) && index_find(p, key, h) == NO_ENTRY) order_insert(s, key);
+
+    int e = p->end;
+    record_at(s, val)->owner = owner_tag(h, p->stamp + 1);
+    write_entry(p, e, key, val, h, ++p->stamp, expires);
+    note_expiry(p, expires);
+    atomic_store_explicit(&p->end, inc_pod_index(e), memory_order_release);
+    link_entry(p, e);
+    if(full) write_end(p);
+    count_op(s, &p->stats.writes, 1);
+    return 0;
+}
+
+// Writes the record rec under key, taking ownership of it: it is freed if not linked
+int write_record(struct s_store* s, const union u_key* key, uint32_t rec, unsigned h, uint32_t expires, int replace) {
+    uint32_t evicted = NO_BLOCK;
+    int res;
+    do {
+        struct s_pod* p = find_pod(s, h);
+        if(lock_pod(s, p)) {
+            arena_free(s, rec);
+            return 1;
+        }
+        if(find_pod(s, h) != p) res = POD_SPLIT;          // Split while we waited for the lock
+        else res = write_pod(s, p, key, rec, h, expires, replace, &evicted);
+        unlock_pod(p);
+    } while(res == POD_SPLIT);
+
+    sample_key(s, key);
+    if(res) arena_free(s, rec);
+    if(evicted != NO_BLOCK) arena_retire(s, evicted);
+    return res;
+}
+
+// Expires ttl seconds from now, never if ttl is 0; with replace set, val replaces the key's values
+int write_store(struct s_store* s, const char* key, const char* val, unsigned ttl, int replace) {
+    if(key == NULL || val == NULL) return 1;
+    uint32_t rec = new_record(s, val);                    // Copy the value before taking the lock
+    if(rec == NO_BLOCK) return 1;
+    union u_key k;
+    unsigned h = pack_key(&k, key);
+    return write_record(s, &k, rec, h, ttl ? now_sec() + ttl : 0, replace);
+}
+
+// Returns 0 if key had a live value, 1 otherwise
+int delete_store(struct s_store* s, const char* key) {
+    if(key == NULL) return 1;
+    union u_key k;
+    unsigned h = pack_key(&k, key);
+    uint32_t now = now_sec();
+    for(;;) {
+        struct s_pod* p = find_pod(s, h);
+        if(lock_pod(s, p)) return 1;
+        if(find_pod(s, h) != p) {                         // Split while we waited for the lock
+            unlock_pod(p);
+            continue;
+        }
+        preserve_pod(s, p);
+        int res = delete_pod(p, &k, h, now);
+        count_op(s, &p->stats.writes, 1);
+        if(s->order != NO_BLOCK) order_remove(s, &k);    // Under the pod lock, so a new write of key cannot slip in first
+        unlock_pod(p);
+        return res;
+    }
+}
+
+//************************************************************************************
+// Read Functions
+//************************************************************************************
+
+// The record may be concurrently recycled, so its bounds are checked before copying
+char* read_entry(struct s_store* s, struct s_entry* e) {
+    uint32_t off = e->val;
+    if(off < ARENA_START || off >= s->arena.limit - sizeof(struct s_record)) return NULL;
+    struct s_record* r = record_at(s, off);
+    uint32_t len = r->len;
+    if(len > VALUE_MAX_LENGTH || len > s->arena.limit - off - sizeof(struct s_record)) return NULL;
+    size_t raw;
+    if(r->packed) return unpack_record(r, len, &raw);
+
+    char* c = malloc(len+1);
+    memcpy(c, r->data, len);
+    c[len] = 0;
+    return c;
+}
+
+// Read functions run without the pod lock: callers retry them if read_retry reports a
+// concurrent writer, so every loop is bounded and nothing is published before validation
+
+int entry_live(const struct s_pod* p, int e) {
+    return e >= 0 && e < ENTRIES_IN_POD && ring_offset(p, e) < ring_offset(p, p->end);
+}
+
+// Returns i if it has not expired, else the first entry after it in its chain that has not
+int skip_expired(const struct s_pod* p, int i, uint32_t now) {
+    for(int n = 0; i != NO_ENTRY && expired(&p->entry[i], now); n++, i = p->entry[i].next) {
+        if(n == ENTRIES_IN_POD) return NO_ENTRY;
+    }
+    return i;
+}
+
+// Returns the entry holding the live value after c's position, or NO_ENTRY if there is none yet
+int cursor_find(const struct s_pod* p, const struct kv_cursor* c, uint32_t now) {
+    if(p->begin == p->end) return NO_ENTRY; // Return if pod empty
+
+    if(c->entry != NO_ENTRY && c->pod == p->id && entry_live(p, c->entry)) {
+        const struct s_entry* e = &p->entry[c->entry];
+        if(e->stamp == c->stamp && e->expires != TOMBSTONE && e->hash == c->hash && same_key(&p->key[c->entry], &c->key)) {
+            return skip_expired(p, e->next, now);
+        }
+    }
+
+    // The last read entry was evicted, moved by a split or unlinked as a tombstone: find the
+    // first newer one by stamp
+    int slot = index_find(p, &c->key, c->hash);
+    if(slot == NO_ENTRY) return NO_ENTRY;             // None found
+    int i = p->index[slot].head;
+    for(int n = 0; n < ENTRIES_IN_POD && i != NO_ENTRY; n++, i = p->entry[i].next) {
+        if(expired(&p->entry[i], now)) continue;
+        if(c->entry == NO_ENTRY || (int32_t) (p->entry[i].stamp - c->stamp) > 0) return i;
+    }
+    return NO_ENTRY;
+}
+
+// Returns the entry the next read with cursor c returns: past the newest value, reads wrap
+// around to the oldest one
+int read_pod(const struct s_pod* p, const struct kv_cursor* c, uint32_t now) {
+    int e = cursor_find(p, c, now);
+    if(e != NO_ENTRY || c->entry == NO_ENTRY) return e;
+    int slot = index_find(p, &c->key, c->hash);
+    return slot == NO_ENTRY ? NO_ENTRY : skip_expired(p, p->index[slot].head, now);
+}
+
+// Reads the value after c's position and moves c to it. Past the newest value this wraps
+// around to the oldest if wrap is set, and returns NULL otherwise
+char* cursor_read(struct s_store* s, struct kv_cursor* c, int wrap) {
+    struct s_pod* p;
+    char*    val;
+    int      e;
+    uint32_t stamp = 0;
+    uint32_t now   = now_sec();
+    for(;;) {
+        p   = find_pod(s, c->hash);
+        unsigned seq = read_begin(s, p);
+        e   = wrap ? read_pod(p, c, now) : cursor_find(p, c, now);
+        val = NULL;
+        if(e != NO_ENTRY) {
+            val   = read_entry(s, &p->entry[e]);
+            stamp = p->entry[e].stamp;
+        }
+        if(!read_retry(p, seq) && find_pod(s, c->hash) == p) break;
+        free(val);
+    }
+    count_op(s, val != NULL ? &p->stats.hits : &p->stats.misses, 1);
+    sample_key(s, &c->key);
+    if(val != NULL) {
+        touch_entry(s, &p->entry[e]);
+        c->pod   = p->id;
+        c->entry = e;
+        c->stamp = stamp;
+    }
+    return val;
+}
+
+// Loads where this thread's kv_store_read left off for c's key. The cache is direct-mapped and
+// a key overwrites whichever shared its slot, so a key read after many others may start over
+void cursor_load(struct kv_cursor* c) {
+    const struct kv_cursor* r = &read_cursor[c->hash & (READ_CURSORS-1)];
+    c->entry = NO_ENTRY;
+    if(cursor_gen == store_gen && r->entry != NO_ENTRY && r->hash == c->hash && same_key(&r->key, &c->key)) *c = *r;
+}
+
+// Records c's position; positions refer to one open of a store, so those of an earlier one go
+void cursor_save(const struct kv_cursor* c) {
+    if(cursor_gen != store_gen) {
+        for(int i = 0; i < READ_CURSORS; i++) read_cursor[i].entry = NO_ENTRY;
+        cursor_gen = store_gen;
+    }
+    read_cursor[c->hash & (READ_CURSORS-1)] = *c;
+}
+
+char* read_store(struct s_store* s, const char* key) {
+    if(key == NULL) return NULL;
+    struct kv_cursor c;
+    c.hash = pack_key(&c.key, key);
+    cursor_load(&c);
+    char* val = cursor_read(s, &c, 1);
+    if(val != NULL) cursor_save(&c);
+    return val;
+}
+
+char** read_pod_all(struct s_store* s, struct s_pod* p, const union u_key* key, unsigned h, uint32_t now) {
+    char** c = calloc(ENTRIES_IN_POD+1, sizeof(char*));
+    int found = 0;
+    int slot  = index_find(p, key, h);
+    if(slot == NO_ENTRY) return c;
+    int i = p->index[slot].head;
+    for(int n = 0; n < ENTRIES_IN_POD && i != NO_ENTRY; n++, i = p->entry[i].next) {
+        if(expired(&p->entry[i], now)) continue;
+        char* v = read_entry(s, &p->entry[i]);
+        if(v == NULL) break;                              // Torn read, the caller retries
+        touch_entry(s, &p->entry[i]);                     // A retried read may count twice
+        c[found++] = v;
+    }
+    return c;
+}
+
+void free_all(char** c) {
+    for(int i = 0; c[i] != NULL; i++) free(c[i]);
+    free(c);
+}
+
+char** read_store_all(struct s_store* s, const char* key) {
+    if(key == NULL) return NULL;
+    union u_key k;
+    unsigned h = pack_key(&k, key);
+    uint32_t now = now_sec();
+
+    char** c;
+    struct s_pod* p;
+    for(;;) {
+        p = find_pod(s, h);
+        unsigned seq = read_begin(s, p);
+        c = read_pod_all(s, p, &k, h, now);
+        if(!read_retry(p, seq) && find_pod(s, h) == p) break;
+        free_all(c);
+    }
+    count_op(s, c[0] != NULL ? &p->stats.hits : &p->stats.misses, 1);
+    sample_key(s, &k);
+    return c;
+}
+
+#define VIEW_NEXT   0                // The value kv_store_read would return, moving the cursor on
+#define VIEW_ALL    1                // Every live value, oldest first
+#define VIEW_NEWEST 2                // The newest live value only
+
+// Collects the records a view of key in mode returns into recs and returns how many. The caller
+// must have pinned the epoch to use the records after this returns
+int view_store(struct s_store* s, const char* key, int mode, uint32_t* recs) {
+    struct kv_cursor c;
+    unsigned h = c.hash = pack_key(&c.key, key);
+    if(mode == VIEW_NEXT) cursor_load(&c);
+    struct s_pod* p;
+    int      n, e;
+    uint32_t stamp = 0;
+    uint32_t now   = now_sec();
+    for(;;) {
+        p = find_pod(s, h);
+        unsigned seq = read_begin(s, p);
+        n = 0;
+        e = NO_ENTRY;
+        if(mode == VIEW_NEXT) {
+            e = read_pod(p, &c, now);
+            if(e != NO_ENTRY) {
+                recs[n++] = p->entry[e].val;
+                stamp     = p->entry[e].stamp;
+            }
+        }
+        else if((e = index_find(p, &c.key, h)) != NO_ENTRY) {
+            int i = p->index[e].head;
+            e = NO_ENTRY;
+            for(int m = 0; m < ENTRIES_IN_POD && i != NO_ENTRY; m++, i = p->entry[i].next) {
+                if(expired(&p->entry[i], now)) continue;
+                if(mode == VIEW_NEWEST) {
+                    e       = i;
+                    recs[0] = p->entry[i].val;
+                    n       = 1;
+                    continue;
+                }
+                touch_entry(s, &p->entry[i]);             // A retried read may count twice
+                recs[n++] = p->entry[i].val;
+            }
+        }
+        if(!read_retry(p, seq) && find_pod(s, h) == p) break;
+    }
+    count_op(s, n ? &p->stats.hits : &p->stats.misses, 1);
+    sample_key(s, &c.key);
+    if(mode != VIEW_ALL && n) touch_entry(s, &p->entry[e]);
+    if(mode == VIEW_NEXT && n) {
+        c.pod   = p->id;
+        c.entry = e;
+        c.stamp = stamp;
+        cursor_save(&c);
+    }
+    return n;
+}
+
+//************************************************************************************
+// Update Functions
+//************************************************************************************
+
+// Newest live entry of key in the locked pod p, NO_ENTRY if it has none
+int newest_entry(struct s_pod* p, const union u_key* key, unsigned h, uint32_t now) {
+    int slot = index_find(p, key, h);
+    int e    = NO_ENTRY;
+    if(slot == NO_ENTRY) return NO_ENTRY;
+    for(int i = p->index[slot].head; i != NO_ENTRY; i = p->entry[i].next) {
+        if(!expired(&p->entry[i], now)) e = i;
+    }
+    return e;
+}
+
+// Locks and returns the pod of hash h, following splits that move the key meanwhile; returns
+// NULL if locking failed
+struct s_pod* lock_hash(struct s_store* s, unsigned h) {
+    for(;;) {
+        struct s_pod* p = find_pod(s, h);
+        if(lock_pod(s, p)) return NULL;
+        if(find_pod(s, h) == p) return p;
+        unlock_pod(p);                                    // Split while we waited for the lock
+    }
+}
+
+// Copies the newest live value of key in the locked pod p to *val, NULL if it has none; returns
+// 1 if it could not be read
+int copy_newest(struct s_store* s, struct s_pod* p, const union u_key* key, unsigned h, char** val) {
+    int e = newest_entry(p, key, h, now_sec());
+    *val = e == NO_ENTRY ? NULL : read_entry(s, &p->entry[e]);
+    return e != NO_ENTRY && *val == NULL;
+}
+
+// The same without the pod lock, so the value may be outdated by the time it is used
+int read_value(struct s_store* s, const union u_key* key, char** val) {
+    *val = NULL;
+    if(epoch_pin(s)) return 1;
+    uint32_t rec = newest_value(s, key, now_sec());
+    if(rec != NO_BLOCK) {
+        char*  buf;
+        size_t len;
+        const char* v = record_value(s, rec, &len, &buf);
+        *val = buf != NULL || v == NULL ? buf : strndup(v, len);
+    }
+    epoch_unpin(s);
+    return rec != NO_BLOCK && *val == NULL;
+}
+
+#define VALUE_CHANGED 3
+
+// Makes rec the key's only value, as kv_store_put would, if its newest live value is still old
+// (NULL: none). Returns 0 if it did, 1 on failure, or VALUE_CHANGED with the newest value in *cur
+int swap_value(struct s_store* s, const union u_key* key, unsigned h, const char* old, uint32_t rec, uint32_t* evicted, char** cur) {
+    int res;
+    do {
+        struct s_pod* p = lock_hash(s, h);
+        if(p == NULL) return 1;
+        res = copy_newest(s, p, key, h, cur);
+        if(res == 0 && (*cur == NULL ? old != NULL : old == NULL || strcmp(*cur, old))) res = VALUE_CHANGED;
+        else if(res == 0) res = write_pod(s, p, key, rec, h, 0, 1, evicted);
+        unlock_pod(p);
+        if(res != VALUE_CHANGED) free(*cur);
+    } while(res == POD_SPLIT);                            // The key may have moved: compare again there
+    return res;
+}
+
+// Gets the newest live value of a key, NULL if it has none, and returns the record to make the
+// key's only value, or NO_BLOCK to leave the key as it is
+typedef uint32_t (*update_fn)(struct s_store* s, const char* old, void* arg);
+
+// Read-modify-write of key, replacing its values as kv_store_put would. fn builds the new record
+// outside the pod lock, so copying, compressing and allocating it do not hold up the pod; it is
+// swapped in only if the value it was built from is still the newest, and built again from the
+// newer one otherwise. Returns 0 if the key was updated
+int update_store(struct s_store* s, const char* key, update_fn fn, void* arg) {
+    if(key == NULL) return 1;
+    union u_key k;
+    unsigned h = pack_key(&k, key);
+    uint32_t evicted = NO_BLOCK;
+    char*    old;
+    int      res = read_value(s, &k, &old);
+    while(res == 0) {
+        char*    cur;
+        uint32_t rec = fn(s, old, arg);
+        res = rec == NO_BLOCK ? 1 : swap_value(s, &k, h, old, rec, &evicted, &cur);
+        if(res && rec != NO_BLOCK) arena_free(s, rec);
+        if(res != VALUE_CHANGED) break;
+        free(old);
+        old = cur;
+        res = 0;
+    }
+    free(old);
+
+    sample_key(s, &k);
+    if(evicted != NO_BLOCK) arena_retire(s, evicted);
+    return res;
+}
+
+struct s_cas {
+    const char* expected;              // NULL: the key must have no value
+    const char* value;
+};
+
+uint32_t cas_value(struct s_store* s, const char* old, void* arg) {
+    struct s_cas* c = arg;
+    if(old == NULL ? c->expected != NULL : c->expected == NULL || strcmp(old, c->expected)) return NO_BLOCK;
+    return new_record(s, c->value);
+}
+
+struct s_incr {
+    long long delta;
+    long long value;                   // The sum, once stored
+};
+
+uint32_t incr_value(struct s_store* s, const char* old, void* arg) {
+    struct s_incr* c = arg;
+    long long v = 0;
+    if(old != NULL) {
+        char* end;
+        errno = 0;
+        v = strtoll(old, &end, 10);
+        if(errno || end == old || *end) return NO_BLOCK;
+    }
+    if(__builtin_add_overflow(v, c->delta, &c->value)) return NO_BLOCK;
+    char buf[24];
+    sprintf(buf, "%lld", c->value);
+    return new_record(s, buf);
+}
+
+//************************************************************************************
+// Batch Functions
+//************************************************************************************
+
+// Batches are processed pod by pod: each pod is locked or validated once for all its keys
+struct s_batch {
+    struct s_pod* pod;
+    unsigned      hash;
+    int           i;                   // Position in the caller's arrays
+    union u_key   key;
+};
+
+int cmp_batch(const void* a, const void* b) {
+    const struct s_batch* x = a;
+    const struct s_batch* y = b;
+    if(x->pod != y->pod) return x->pod < y->pod ? -1 : 1;
+    return x->i - y->i;                                   // Same pod: keep the caller's order
+}
+
+// Sorts the batch by pod; returns NULL if the keys could not be hashed or memory ran out
+struct s_batch* sort_batch(struct s_store* s, const char** keys, int n) {
+    struct s_batch* b = malloc(n * sizeof(struct s_batch));
+    if(b == NULL) return NULL;
+    for(int i = 0; i < n; i++) {
+        if(keys[i] == NULL) {
+            free(b);
+            return NULL;
+        }
+        b[i].hash = pack_key(&b[i].key, keys[i]);
+        b[i].pod  = find_pod(s, b[i].hash);
+        b[i].i    = i;
+    }
+    qsort(b, n, sizeof(struct s_batch), cmp_batch);
+    return b;
+}
+
+// Returns the end of the run of entries starting at i that share a pod
+int batch_group(const struct s_batch* b, int n, int i) {
+    int j = i;
+    while(j < n && b[j].pod == b[i].pod) j++;
+    if(j < n) {
+        __builtin_prefetch(b[j].pod);                     // Warm the next pod while this one is locked
+        __builtin_prefetch(&b[j].pod->tag[hash_slot(b[j].hash)]);
+    }
+    return j;
+}
+
+// Writes values[i] under keys[i] and stores each write's result in res[i]
+void write_store_batch(struct s_store* s, const char** keys, const char** vals, int n, int* res) {
+    struct s_batch* b = sort_batch(s, keys, n);
+    uint32_t* rec     = malloc(n * sizeof(uint32_t));
+    uint32_t* evicted = malloc(n * sizeof(uint32_t));
+    if(b == NULL || rec == NULL || evicted == NULL) {
+        for(int i = 0; i < n; i++) res[i] = write_store(s, keys[i], vals[i], 0, 0);
+        free(b), free(rec), free(evicted);
+        return;
+    }
+    for(int i = 0; i < n; i++) {
+        rec[i]     = vals[i] == NULL ? NO_BLOCK : new_record(s, vals[i]);
+        evicted[i] = NO_BLOCK;
+        res[i]     = rec[i] == NO_BLOCK ? 1 : POD_SPLIT;  // POD_SPLIT marks pairs still to be written
+    }
+
+    for(int i = 0, j; i < n; i = j) {
+        j = batch_group(b, n, i);
+        struct s_pod* p = b[i].pod;
+        if(lock_pod(s, p)) continue;
+        for(int k = i; k < j; k++) {
+            int x = b[k].i;
+            if(res[x] != POD_SPLIT || find_pod(s, b[k].hash) != p) continue;
+            res[x] = write_pod(s, p, &b[k].key, rec[x], b[k].hash, 0, 0, &evicted[x]);
+            if(res[x] == POD_SPLIT) break;                // Keys moved: the rest of the run goes one by one
+            if(res[x]) arena_free(s, rec[x]);
+        }
+        unlock_pod(p);
+    }
+
+    for(int k = 0; k < n; k++) {
+        int x = b[k].i;
+        if(res[x] == POD_SPLIT) res[x] = write_record(s, &b[k].key, rec[x], b[k].hash, 0, 0);
+        else sample_key(s, &b[k].key);                    // write_record samples the others
+        if(evicted[x] != NO_BLOCK) arena_retire(s, evicted[x]);
+    }
+    free(b), free(rec), free(evicted);
+}
+
+// Returns an array with what kv_store_read would return for each key, in order
+char** read_store_batch(struct s_store* s, const char** keys, int n) {
+    char** vals = calloc(n, sizeof(char*));
+    struct s_batch*   b   = sort_batch(s, keys, n);
+    struct kv_cursor* cur = malloc(n * sizeof(struct kv_cursor));
+    if(vals == NULL || b == NULL || cur == NULL) {
+        free(b), free(cur), free(vals);
+        return NULL;
+    }
+
+    uint32_t now = now_sec();
+    for(int i = 0, j; i < n; i = j) {
+        j = batch_group(b, n, i);
+        struct s_pod* p = b[i].pod;
+        for(;;) {
+            unsigned seq = read_begin(s, p);
+            for(int k = i; k < j; k++) {
+                struct kv_cursor* c = &cur[k];
+                int d = k-1;
+                while(d >= i && !(cur[d].hash == b[k].hash && same_key(&cur[d].key, &b[k].key))) d--;
+                if(d >= i) *c = cur[d];                   // Repeated key: move on from its previous read
+                else {
+                    c->key  = b[k].key;
+                    c->hash = b[k].hash;
+                    cursor_load(c);
+                }
+                int e = read_pod(p, c, now);
+                if(e == NO_ENTRY) continue;
+                vals[b[k].i] = read_entry(s, &p->entry[e]);
+                touch_entry(s, &p->entry[e]);             // A retried read may count twice
+                c->pod   = p->id;
+                c->entry = e;
+                c->stamp = p->entry[e].stamp;
+            }
+            if(!read_retry(p, seq)) break;
+            for(int k = i; k < j; k++) {
+                free(vals[b[k].i]);
+                vals[b[k].i] = NULL;
+            }
+        }
+        // Keys whose pod split since sorting are read again from their new pod
+        for(int k = i; k < j; k++) {
+            int x = b[k].i;
+            if(find_pod(s, b[k].hash) != p) {
+                free(vals[x]);
+                vals[x] = read_store(s, keys[x]);
+            }
+            else {
+                count_op(s, vals[x] != NULL ? &p->stats.hits : &p->stats.misses, 1);
+                sample_key(s, &b[k].key);
+                if(vals[x] != NULL) cursor_save(&cur[k]);
+            }
+        }
+    }
+    free(b), free(cur);
+    return vals;
+}
+
+//************************************************************************
+// Debug functions
+//************************************************************************
+void printf_entry(struct s_store* s, const struct s_pod* p, int i) {
+    const struct s_entry* e = &p->entry[i];
+    if(e->val == NO_BLOCK) printf("%.*s\t\n", KEY_MAX_LENGTH, p->key[i].str);
+    else {
+        char*  buf;
+        size_t len;
+        const char* v = record_value(s, e->val, &len, &buf);
+        printf("%.*s\t%.*s\n", KEY_MAX_LENGTH, p->key[i].str, v ? (int) len : 0, v ? v : "");
+        free(buf);
+    }
+}
+
+void printf_pod(struct s_store* s, const struct s_pod* p) {
+    for(int i = 0; i < ENTRIES_IN_POD; i++) {
+        printf_entry(s, p, i);
+    }
+    printf("\n");
+}
+
+uint64_t load_counter(const uint64_t* c) {
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+// Fills ps from p without its lock: occupancy is retried like a read, counters are read as they are
+void pod_stats(struct s_store* s, struct s_pod* p, struct kv_pod_stats* ps) {
+    memset(ps, 0, sizeof(*ps));
+    unsigned seq;
+    do {
+        seq = read_begin(s, p);
+        ps->entries   = ring_offset(p, p->end);
+        ps->keys      = 0;
+        ps->max_chain = 0;
+        for(int i = 0; i < INDEX_SLOTS; i++) {
+            if(p->tag[i] == 0) continue;
+            unsigned n = 0;
+            for(int e = p->index[i].head; e >= 0 && e < ENTRIES_IN_POD && n < ENTRIES_IN_POD; e = p->entry[e].next) n++;
+            if(n > ps->max_chain) ps->max_chain = n;
+            ps->keys++;
+        }
+    } while(read_retry(p, seq));
+    ps->id           = p->id;
+    ps->max_probe    = __atomic_load_n(&p->stats.max_probe, __ATOMIC_RELAXED);
+    ps->writes       = load_counter(&p->stats.writes);
+    ps->hits         = load_counter(&p->stats.hits);
+    ps->misses       = load_counter(&p->stats.misses);
+    ps->evictions    = load_counter(&p->stats.evictions);
+    ps->expired      = load_counter(&p->stats.expired);
+    ps->lock_waits   = load_counter(&p->stats.lock_waits);
+    ps->lock_wait_ns = load_counter(&p->stats.lock_wait_ns);
+}
+
+void add_stats(struct kv_pod_stats* t, const struct kv_pod_stats* ps) {
+    t->entries      += ps->entries;
+    t->keys         += ps->keys;
+    t->writes       += ps->writes;
+    t->hits         += ps->hits;
+    t->misses       += ps->misses;
+    t->evictions    += ps->evictions;
+    t->expired      += ps->expired;
+    t->lock_waits   += ps->lock_waits;
+    t->lock_wait_ns += ps->lock_wait_ns;
+    if(ps->max_chain > t->max_chain) t->max_chain = ps->max_chain;
+    if(ps->max_probe > t->max_probe) t->max_probe = ps->max_probe;
+}
+
+int cmp_hot(const void* a, const void* b) {
+    const struct kv_hot_key* x = a;
+    const struct kv_hot_key* y = b;
+    if(x->count != y->count) return x->count > y->count ? -1 : 1;
+    return strcmp(x->key, y->key);
+}
+
+// Sums the counters of every pod into st, passing each pod's to cb if not NULL, and copies the
+// hot key table, most used first
+void stats_store(struct s_store* s, struct kv_stats* st, kv_pod_stats_cb cb, void* arg) {
+    struct kv_pod_stats ps;
+    memset(st, 0, sizeof(*st));
+    st->pods = atomic_load(&s->npods);
+    for(uint32_t id = 0; id < st->pods; id++) {
+        pod_stats(s, pod_at(s, id), &ps);
+        if(cb != NULL) cb(&ps, arg);
+        add_stats(&st->total, &ps);
+    }
+
+    int status = pthread_mutex_lock(&s->hot_lock);
+    if(status == EOWNERDEAD) status = pthread_mutex_consistent(&s->hot_lock);
+    if(status) return;
+    for(int i = 0; i < KV_HOT_KEYS; i++) {
+        if(s->hot[i].count == 0) continue;
+        struct kv_hot_key* h = &st->hot[st->nhot++];
+        memcpy(h->key, s->hot[i].key.str, KEY_MAX_LENGTH);
+        h->key[KEY_MAX_LENGTH] = 0;
+        h->count = s->hot[i].count;
+    }
+    pthread_mutex_unlock(&s->hot_lock);
+    qsort(st->hot, st->nhot, sizeof(struct kv_hot_key), cmp_hot);
+}
+
+//************************************************************************************
+// Persistence Functions
+//************************************************************************************
+
+uint32_t fnv(uint32_t h, const void* data, size_t len) {
+    const uint8_t* b = data;
+    for(size_t i = 0; i < len; i++) h = (h ^ b[i]) * 16777619u;
+    return h;
+}
+
+// Covers everything needed to find pods and records, but not locks or reader state
+uint32_t header_checksum(struct s_store* s) {
+    uint32_t h = 2166136261u;
+    unsigned depth = atomic_load(&s->depth);
+    unsigned npods = atomic_load(&s->npods);
+    if(depth > MAX_DEPTH || npods > MAX_PODS) return 0;
+    h = fnv(h, &s->magic,   sizeof(s->magic));
+    h = fnv(h, &s->version, sizeof(s->version));
+    h = fnv(h, s->geometry, sizeof(s->geometry));
+    h = fnv(h, &s->policy,  sizeof(s->policy));
+    h = fnv(h, &s->ordered, sizeof(s->ordered));
+    h = fnv(h, &s->stats,   sizeof(s->stats));
+    h = fnv(h, &s->compress, sizeof(s->compress));
+    h = fnv(h, &s->order,   sizeof(s->order));
+    h = fnv(h, &s->arena.top, offsetof(struct s_arena, retire_end) + sizeof(uint32_t) - offsetof(struct s_arena, top));
+    h = fnv(h, &depth, sizeof(depth));
+    h = fnv(h, &npods, sizeof(npods));
+    h = fnv(h, s->pod, npods * sizeof(uint32_t));
+    h = fnv(h, s->dir, (1u << depth) * sizeof(uint32_t));
+    return h;
+}
+
+int sync_header(struct s_store* s) {
+    return msync(s, ARENA_START, MS_SYNC) != 0;
+}
+
+void mark_clean(struct s_store* s) {
+    msync(s, s->arena.limit, MS_SYNC);
+    s->checksum = header_checksum(s);
+    atomic_store(&s->clean, 1);
+    sync_header(s);
+}
+
+// Marks the store in use; synced so a crash can never leave a modified store marked clean
+void mark_dirty(struct s_store* s) {
+    if(atomic_exchange(&s->clean, 0)) sync_header(s);
+}
+
+// Open file description lock on the first byte: shared while attached, exclusive to (re)start
+int lock_file(int fd, short type, int wait) {
+    struct flock fl = { .l_type = type, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1 };
+    return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+}
+
+int valid_block(struct s_store* s, uint32_t off) {
+    if(off < ARENA_START || off >= s->arena.top || (off - ARENA_START) % MIN_BLOCK) return 0;
+    struct s_record* r = record_at(s, off);
+    return r->cls < NUM_CLASSES && off + (MIN_BLOCK << r->cls) <= s->arena.top &&
+           sizeof(struct s_record) + r->len <= (size_t) (MIN_BLOCK << r->cls);
+}
+
+void mark_live(uint8_t* live, uint32_t off) {
+    uint32_t bit = (off - ARENA_START) / MIN_BLOCK;
+    live[bit / 8] |= 1 << bit % 8;
+}
+
+int is_live(const uint8_t* live, uint32_t off) {
+    uint32_t bit = (off - ARENA_START) / MIN_BLOCK;
+    return live[bit / 8] & 1 << bit % 8;
+}
+
+// Nobody else is attached: locks and reader state left by earlier processes are reset
+int reset_store(struct s_store* s) {
+    if(init_lock(&s->arena.lock) || init_lock(&s->dir_lock) || init_lock(&s->order_lock) || init_lock(&s->hot_lock)) return 1;
+    for(uint32_t id = 0; id < atomic_load(&s->npods); id++) {
+        struct s_pod* p = pod_at(s, id);
+        if(init_lock(&p->lock)) return 1;
+        atomic_store(&p->seq, 0);
+    }
+    for(int i = 0; i < MAX_READERS; i++) {
+        atomic_store(&s->reader[i].tid, 0);
+        atomic_store(&s->reader[i].epoch, 0);
+    }
+    atomic_store(&s->snap_owner, 0);                      // A snapshot left running has no taker any more
+    if(atomic_load(&s->snap) || s->snap_table != NO_BLOCK) end_snapshot(s);
+    while(s->arena.retire_begin != s->arena.retire_end) {  // No reader can hold a retired record
+        uint32_t off = retire_slot(s, s->arena.retire_begin)[0];
+        s->arena.retire_begin++;
+        push_free(s, off);
+    }
+    return 0;
+}
+
+// Rebuilds the store from its pods after a crash: the directory from the pods' prefixes, each
+// pod from its valid entries, and the free lists from the blocks no pod or entry uses. The
+// ordered index is dropped with them, to be rebuilt by start_store
+int recover_store(struct s_store* s, off_t size) {
+    struct s_arena* a = &s->arena;
+    unsigned npods = atomic_load(&s->npods);
+    if(a->top > a->limit || a->limit > size || npods == 0 || npods > MAX_PODS || s->policy > KV_EVICT_LFU) return 1;
+
+    uint8_t* live = calloc((a->top - ARENA_START) / MIN_BLOCK / 8 + 1, 1);  // One bit per MIN_BLOCK
+    if(live == NULL) return 1;
+
+    // Deeper pods are newer halves of a split: they win the directory slots they cover
+    unsigned depth = 0;
+    for(uint32_t id = 0; id < npods; id++) {
+        if(!valid_block(s, s->pod[id]) || pod_at(s, id)->depth > MAX_DEPTH) {
+            free(live);
+            return 1;
+        }
+        mark_live(live, s->pod[id]);
+        if(pod_at(s, id)->depth > depth) depth = pod_at(s, id)->depth;
+    }
+    for(unsigned i = 0; i < (1u << depth); i++) atomic_store(&s->dir[i], MAX_PODS);
+    for(unsigned d = 0; d <= depth; d++) {
+        for(uint32_t id = 0; id < npods; id++) {
+            struct s_pod* p = pod_at(s, id);
+            if(p->depth != d) continue;
+            for(unsigned i = p->prefix; i < (1u << depth); i += 1u << d) atomic_store(&s->dir[i], id);
+        }
+    }
+    for(unsigned i = 0; i < (1u << depth); i++) {
+        if(atomic_load(&s->dir[i]) == MAX_PODS) {
+            free(live);
+            return 1;
+        }
+    }
+    atomic_store(&s->depth, depth);
+
+    // Keep the entries whose record is intact and which the directory still maps to their pod
+    for(uint32_t id = 0; id < npods; id++) {
+        struct s_pod* p = pod_at(s, id);
+        p->id = id;
+        if(p->begin < 0 || p->begin >= ENTRIES_IN_POD || p->end < 0 || p->end >= ENTRIES_IN_POD) {
+            p->begin = p->end = 0;
+        }
+        int w = p->begin;
+        p->expiry = 0;
+        for(int e = p->begin; e != p->end; e = inc_pod_index(e)) {
+            struct s_entry* en = &p->entry[e];
+            uint32_t mask = (1u << depth) - 1;
+            if(atomic_load(&s->dir[en->hash & mask]) != id || !valid_block(s, en->val) || is_live(live, en->val)) continue;
+            if(en->hash != hash(&p->key[e]) || record_at(s, en->val)->owner != owner_tag(en->hash, en->stamp)) continue;
+            mark_live(live, en->val);
+            if((int32_t) (en->stamp - p->stamp) > 0) p->stamp = en->stamp;
+            note_expiry(p, en->expires);
+            if(w != e) copy_entry(p, w, p, e);
+            w = inc_pod_index(w);
+        }
+        p->end = w;
+        rebuild_pod(p);
+    }
+
+    // Every block that is neither a pod nor a kept record goes back to its free list
+    for(int c = 0; c < NUM_CLASSES; c++) a->free_list[c] = NO_BLOCK;
+    a->retired  = NO_BLOCK;
+    a->retire_begin = a->retire_end = 0;
+    s->order    = NO_BLOCK;
+    s->snap_table = NO_BLOCK;                             // Snapshot copies are freed with the rest
+    s->split_pod  = MAX_PODS;                             // The directory above already settled any split
+    atomic_store(&s->snap, 0);
+    for(uint32_t off = ARENA_START; off < a->top; off += MIN_BLOCK << record_at(s, off)->cls) {
+        uint32_t cls = record_at(s, off)->cls;
+        if(cls >= NUM_CLASSES || off + (MIN_BLOCK << cls) > a->top) {
+            free(live);
+            return 1;
+        }
+        if(!is_live(live, off)) push_free(s, off);
+    }
+    free(live);
+    return 0;
+}
+
+// An initialized store can only be used by binaries built with the same layout and geometry
+int check_layout(struct s_store* s) {
+    if(s->version != STORE_VERSION) {
+        printf("Store was created with an incompatible layout\n");
+        return 1;
+    }
+    if(memcmp(s->geometry, store_geometry, sizeof(store_geometry))) {
+        printf("Store was created with another geometry (%u entries per pod, %u index slots, depth %u, "
+               "keys %u, values %u)\n", s->geometry[0], s->geometry[1], s->geometry[2], s->geometry[3], s->geometry[4]);
+        return 1;
+    }
+    return 0;
+}
+
+// Called with the file locked exclusively: initializes a new store or restarts an existing one
+// policy and flags are the eviction policy and KV_* flags of a store created here
+int start_store(struct s_store* s, int fd, int policy, int flags) {
+    struct stat st;
+    if(fstat(fd, &st)) return 1;
+
+    if(st.st_size < (off_t) ARENA_START || s->magic != STORE_MAGIC) {
+        if(ftruncate(fd, align_segment(ARENA_START)) || init_store(s, policy, flags)) return 1;
+    }
+    else if(check_layout(s)) return 1;
+    else if(!(atomic_load(&s->clean) && s->checksum == header_checksum(s))) {
+        printf("Store was not closed cleanly, recovering\n");
+        if(recover_store(s, st.st_size)) {
+            printf("Store is damaged beyond recovery\n");
+            return 1;
+        }
+    }
+    if(reset_store(s)) return 1;
+    if(s->ordered && s->order == NO_BLOCK && build_order(s)) return 1;
+    mark_dirty(s);
+    return 0;
+}
+
+// The first process to attach starts the store, the others wait for it on the file lock
+int attach_store(struct s_store* s, int fd, int policy, int flags) {
+    for(;;) {
+        if(lock_file(fd, F_WRLCK, 0) == 0) {
+            int status = start_store(s, fd, policy, flags);
+            if(status == 0) status = lock_file(fd, F_RDLCK, 0);  // Atomic downgrade
+            if(status) printf("Failed to initialize store\n");
+            return status;
+        }
+        if(errno != EAGAIN && errno != EACCES) return 1;
+        if(lock_file(fd, F_RDLCK, 1)) return 1;
+        if(s->magic == STORE_MAGIC) {
+            if(check_layout(s)) {
+                lock_file(fd, F_UNLCK, 0);
+                return 1;
+            }
+            mark_dirty(s);                                // In case the last process just closed it
+            return 0;
+        }
+        lock_file(fd, F_UNLCK, 0);                        // Its initializer died, try to take over
+    }
+}
+
+void sync_store(struct s_store* s) {
+    msync(s, s->arena.limit, MS_SYNC);
+}
+
+//***********************************************************************
+// Key-Value Store API
+//***********************************************************************
+
+// kv_store_open and kv_store_create are macros in config.h; the parentheses keep them out of the
+// names of the functions behind them
+int (kv_store_open)(const char* name, const struct kv_options* opt) {
+    static int fork_handler = 0;
+    if(!fork_handler) fork_handler = !pthread_atfork(NULL, NULL, reset_child);
+    if(mm_store != NULL) {
+        printf("Store already open\n");
+        return 1;
+    }
+
+    int policy = opt != NULL ? opt->eviction : KV_EVICT_FIFO;
+    if(policy < KV_EVICT_FIFO || policy > KV_EVICT_LFU) {
+        printf("Unknown eviction policy\n");
+        return 1;
+    }
+    if(opt != NULL && (opt->numa < KV_NUMA_DEFAULT || opt->numa > KV_NUMA_BIND)) {
+        printf("Unknown NUMA policy\n");
+        return 1;
+    }
+
+    store_file = opt != NULL && (opt->flags & KV_FILE_BACKED);
+    int fd = store_file ? open(name, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR)
+                        : shm_open(name, O_CREAT|O_RDWR, S_IRWXU);
+    if(fd < 0) {
+        printf("Failed to create shared memory object\n");
+        return 1;
+    }
+
+    // Reserve the maximum size up front: growing the object later never moves the mapping
+    char* addr = mmap(NULL, MAX_STORE_BYTES, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, fd, 0);
+    if(addr == MAP_FAILED) {
+        printf("Failed to map shared memory object\n");
+        close(fd);
+        return 1;
+    }
+    mm_store = (struct s_store*) addr;
+    store_fd = fd;
+    store_gen++;
+
+    if(map_segment(addr, fd, opt) || attach_store(mm_store, fd, policy, opt != NULL ? opt->flags : 0) ||
+       populate_segment(mm_store, 0, mm_store->arena.limit)) {
+        munmap(addr, MAX_STORE_BYTES);
+        close(fd);
+        mm_store = NULL;
+        store_fd = -1;
+        return 1;
+    }
+    if(opt != NULL && opt->checkpoint_ms) start_task(&checkpointer, opt->checkpoint_ms, sync_store);
+    if(opt != NULL && opt->sweep_ms)      start_task(&sweeper, opt->sweep_ms, sweep_store);
+
+    db_name = calloc(strlen(name)+1, sizeof(char));
+    strcpy(db_name, name);
+    return 0;
+}
+
+// What kv_store_open and kv_store_create call: key_max and value_max are the limits the caller
+// was built with, and must be the library's, since they size struct kv_hot_key and the caller's
+// buffers for keys and values
+int kv_store_open_geometry(const char* name, const struct kv_options* opt, unsigned key_max, unsigned value_max) {
+    if(key_max != KEY_MAX_LENGTH || value_max != VALUE_MAX_LENGTH) {
+        printf("Caller was built with keys %u, values %u, the store library with keys %u, values %u\n",
+               key_max, value_max, KEY_MAX_LENGTH, VALUE_MAX_LENGTH);
+        return 1;
+    }
+    return (kv_store_open)(name, opt);
+}
+
+int (kv_store_create)(const char* name) {
+    return (kv_store_open)(name, NULL);
+}
+
+int kv_store_write(const char* key, const char* value) {
+    return write_store(mm_store, key, value, 0, 0); //note: returns 0 on success, 1 on failure
+}
+
+int kv_store_write_ttl(const char* key, const char* value, unsigned ttl) {
+    return write_store(mm_store, key, value, ttl, 0);
+}
+
+int kv_store_put(const char* key, const char* value) {
+    return write_store(mm_store, key, value, 0, 1);
+}
+
+int kv_store_delete(const char* key) {
+    return delete_store(mm_store, key);
+}
+
+int kv_store_cas(const char* key, const char* expected, const char* value) {
+    if(value == NULL) return 1;
+    struct s_cas c = { expected, value };
+    return update_store(mm_store, key, cas_value, &c);
+}
+
+int kv_store_incr(const char* key, long long delta, long long* result) {
+    struct s_incr c = { delta, 0 };
+    int res = update_store(mm_store, key, incr_value, &c);
+    if(res == 0 && result != NULL) *result = c.value;
+    return res;
+}
+
+char* kv_store_read(const char* key) {
+    return read_store(mm_store, key);
+}
+
+char** kv_store_read_all(const char* key) {
+    char** c = read_store_all(mm_store, key);
+    if(c[0] == NULL) { //To satisfy automatic test
+        free(c);
+        c = NULL;
+    }
+    return c;
+}
+
+// Calls cb on the value kv_store_read would return, in place and without copying
+int kv_store_read_view(const char* key, kv_view_cb cb, void* arg) {
+    if(key == NULL || cb == NULL || epoch_pin(mm_store)) return 1;
+    uint32_t rec;
+    int n = view_store(mm_store, key, VIEW_NEXT, &rec);
+    if(n) {
+        char*  buf;
+        size_t len;
+        const char* v = record_value(mm_store, rec, &len, &buf);
+        if(v != NULL) cb(v, len, arg);
+        free(buf);
+    }
+    epoch_unpin(mm_store);
+    return !n;
+}
+
+// Calls cb on key's newest live value, in place, leaving the kv_store_read position as it is
+int kv_store_read_newest_view(const char* key, kv_view_cb cb, void* arg) {
+    if(key == NULL || cb == NULL || epoch_pin(mm_store)) return 1;
+    uint32_t rec;
+    int n = view_store(mm_store, key, VIEW_NEWEST, &rec);
+    if(n) {
+        char*  buf;
+        size_t len;
+        const char* v = record_value(mm_store, rec, &len, &buf);
+        if(v != NULL) cb(v, len, arg);
+        free(buf);
+    }
+    epoch_unpin(mm_store);
+    return !n;
+}
+
+// Calls cb on each value of key, oldest first, until cb returns non-zero
+int kv_store_read_all_view(const char* key, kv_view_cb cb, void* arg) {
+    if(key == NULL || cb == NULL || epoch_pin(mm_store)) return 1;
+    uint32_t recs[ENTRIES_IN_POD];
+    int n = view_store(mm_store, key, VIEW_ALL, recs);
+    for(int i = 0; i < n; i++) {
+        char*  buf;
+        size_t len;
+        const char* v = record_value(mm_store, recs[i], &len, &buf);
+        int stop = v != NULL && cb(v, len, arg);
+        free(buf);
+        if(stop) break;
+    }
+    epoch_unpin(mm_store);
+    return !n;
+}
+
+// Calls cb on each key starting with prefix, in byte order, with its newest value in place
+int kv_store_scan(const char* prefix, kv_scan_cb cb, void* arg) {
+    if(prefix == NULL || cb == NULL || mm_store == NULL) return 1;
+    if(mm_store->order == NO_BLOCK) {
+        printf("Store has no ordered index\n");
+        return 1;
+    }
+    if(epoch_pin(mm_store)) return 1;
+    scan_store(mm_store, prefix, cb, arg);
+    epoch_unpin(mm_store);
+    return 0;
+}
+
+// Streams the pairs live at the time of the call to cb while writers carry on
+int kv_store_snapshot(kv_scan_cb cb, void* arg) {
+    if(cb == NULL || mm_store == NULL || epoch_pin(mm_store)) return 1;
+    int status = snapshot_store(mm_store, cb, arg);
+    epoch_unpin(mm_store);
+    return status;
+}
+
+// Reports the store's counters; they are approximate, since writers are not stopped
+int kv_store_stats(struct kv_stats* st, kv_pod_stats_cb cb, void* arg) {
+    if(st == NULL || mm_store == NULL) return 1;
+    stats_store(mm_store, st, cb, arg);
+    return 0;
+}
+
+// Writes n pairs, taking each pod lock once; res[i] gets what kv_store_write would have returned
+int kv_store_write_batch(const char** keys, const char** values, int n, int* res) {
+    if(keys == NULL || values == NULL || res == NULL || n < 0) return 1;
+    write_store_batch(mm_store, keys, values, n, res);
+    for(int i = 0; i < n; i++) if(res[i]) return 1;
+    return 0;
+}
+
+// Reads the next value of each of n keys; the caller frees each value and the array
+char** kv_store_read_batch(const char** keys, int n) {
+    if(keys == NULL || n <= 0) return NULL;
+    return read_store_batch(mm_store, keys, n);
+}
+
+// Opens a cursor over key's values, oldest first; it may outlive the values it has read
+struct kv_cursor* kv_cursor_open(const char* key) {
+    if(key == NULL || mm_store == NULL) return NULL;
+    struct kv_cursor* c = malloc(sizeof(struct kv_cursor));
+    if(c == NULL) return NULL;
+    c->hash  = pack_key(&c->key, key);
+    c->entry = NO_ENTRY;
+    return c;
+}
+
+// Returns the next newer value of the cursor's key, or NULL if there is none yet
+char* kv_cursor_next(struct kv_cursor* c) {
+    if(c == NULL || mm_store == NULL) return NULL;
+    return cursor_read(mm_store, c, 0);
+}
+
+void kv_cursor_close(struct kv_cursor* c) {
+    free(c);
+}
+
+// Flushes the mapped store to its backing file. After a system crash, pages changed since the last
+// checkpoint may have reached the file in any order: recovery keeps an entry only if its record
+// still carries the entry's owner tag, so values written since may be lost, and keys may come back
+// with values they held at some point since, but never with another entry's value
+int kv_store_checkpoint() {
+    if(mm_store == NULL) return 1;
+    return msync(mm_store, mm_store->arena.limit, MS_SYNC) != 0;
+}
+
+// Detaches from the store without deleting it; the last process to close it marks it clean
+int kv_store_close() {
+    if(mm_store == NULL) return 1;
+    stop_task(&checkpointer);
+    stop_task(&sweeper);
+    if(lock_file(store_fd, F_WRLCK, 0) == 0) mark_clean(mm_store);
+    munmap(mm_store, MAX_STORE_BYTES);
+    close(store_fd);                                      // Also drops this process's file lock
+    mm_store = NULL;
+    store_fd = -1;
+    free(db_name);
+    db_name = NULL;
+    return 0;
+}
+
+int kv_delete_db() {
+    stop_task(&checkpointer);
+    stop_task(&sweeper);
+    munmap(mm_store, MAX_STORE_BYTES);
+    close(store_fd);
+    store_fd = -1;
+    mm_store = NULL;
+
+    if(store_file) {
+        int status = unlink(db_name);
+        free(db_name);
+        db_name = NULL;
+        return status != 0;
+    }
 
     int fd = shm_unlink(db_name);
     if(fd < 0) {